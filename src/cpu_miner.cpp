@@ -0,0 +1,774 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "sha2.h"
+#include "sha512_mb.h"
+#include "momentum.h"
+#include "cpu_miner.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+
+extern bool g_dbg_flag;
+extern unsigned int g_stat_every_turns;
+extern unsigned int g_total_ignored;
+
+#define CPU_HASHES_PER_TURN     ((1u << NONCE_BITS) / BIRTHDAYS_PER_HASH)
+#define CPU_CHUNK_HASHES        4096    /* hashes a worker grabs at a time */
+#define CPU_NONCE_MASK          ((1u << NONCE_BITS) - 1)
+
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#define CPU_PREFETCH(p)         _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+#define CPU_PREFETCH(p)         __builtin_prefetch((p), 1, 3)
+#endif
+
+//full cache line writes that bypass the cache, the partition engine never reads them back soon
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CPU_STREAM_LINE(dst, src)   do{ \
+        for(unsigned int q = 0; q < CPU_CACHE_LINE / 16; q++) \
+            _mm_stream_si128((__m128i *)(dst) + q, _mm_load_si128((const __m128i *)(src) + q)); \
+    }while(0)
+#define CPU_STREAM_FENCE()      _mm_sfence()
+#else
+#define CPU_STREAM_LINE(dst, src)   memcpy((dst), (src), CPU_CACHE_LINE)
+#define CPU_STREAM_FENCE()
+#endif
+
+/*
+ * Table slot: valid bit | birthday bits above the index | nonce.
+ * The index and the stored bits together cover all SEARCH_SPACE_BITS,
+ * so a tag match is an exact birthday collision, no host re-hash needed.
+ */
+#define CPU_SLOT_VALID          (1ULL << 63)
+#define CPU_CACHE_LINE          64
+
+typedef std::atomic<uint64> cpu_slot;
+
+/*
+ * The index picks a bucket, one cache line of slots filled from the front,
+ * so a probe costs one miss and a busy index keeps several birthdays
+ * instead of only the last one.
+ */
+#define CPU_BUCKET_SLOTS        (CPU_CACHE_LINE / sizeof(cpu_slot))
+
+typedef struct {
+    cpu_slot slot[CPU_BUCKET_SLOTS];
+} cpu_bucket;
+
+/*
+ * Partition engine: the top CPU_PART_BITS birthday bits pick a partition,
+ * which keeps valid bit | the other birthday bits | nonce records. At ~8K
+ * records (64 KB) a partition stays in L2 while its collisions are found.
+ * Workers gather records per partition in a cache line and stream out
+ * whole lines, so the scatter is sequential writes instead of random ones.
+ */
+#define CPU_PART_BITS           13
+#define CPU_PARTS               (1u << CPU_PART_BITS)
+#define CPU_LINE_RECORDS        (CPU_CACHE_LINE / sizeof(uint64))
+#define CPU_PART_KEY_MASK       ((1ULL << (SEARCH_SPACE_BITS - CPU_PART_BITS)) - 1)
+#define CPU_PART_TABLE_BITS     15      //matching table, 16-bit record indices
+
+#if SEARCH_SPACE_BITS - CPU_PART_BITS + NONCE_BITS > 63
+#error "partition records need CPU_PART_BITS birthday bits taken out"
+#endif
+
+typedef struct {
+    uint64 rec[CPU_PARTS][CPU_LINE_RECORDS];
+    unsigned char count[CPU_PARTS];
+} cpu_part_lines;
+
+/*
+ * Sort engine: every birthday is kept, keys and nonces side by side, and
+ * LSD radix sorted on the birthday a CPU_SORT_DIGIT_BITS digit per pass.
+ * Equal birthdays end up adjacent, so one scan finds every collision and
+ * nothing is ever dropped, at the price of two copies of all records.
+ */
+#define CPU_SORT_RECORDS        (1u << NONCE_BITS)
+#define CPU_SORT_DIGIT_BITS     10
+#define CPU_SORT_BUCKETS        (1u << CPU_SORT_DIGIT_BITS)
+#define CPU_SORT_PASSES         ((SEARCH_SPACE_BITS + CPU_SORT_DIGIT_BITS - 1) / CPU_SORT_DIGIT_BITS)
+
+static enum cpu_engines g_cpu_engine = CPU_ENGINE_TABLE;
+
+static char *g_cpu_table_mem = NULL;        //g_cpu_table is this, line aligned
+static cpu_bucket *g_cpu_table = NULL;
+static char *g_cpu_parts_mem = NULL;
+static uint64 *g_cpu_parts = NULL;          //CPU_PARTS x g_cpu_part_cap records
+static unsigned int g_cpu_part_cap = 0;
+static char *g_cpu_lines_mem = NULL;
+static cpu_part_lines *g_cpu_lines = NULL;  //one per worker
+static std::atomic<unsigned int> g_cpu_part_fill[CPU_PARTS];
+static std::atomic<unsigned int> g_cpu_next_part(0);
+static uint64 *g_cpu_sort_key[2] = { NULL, NULL };     //birthdays, pass source and target
+static uint32 *g_cpu_sort_nonce[2] = { NULL, NULL };
+static unsigned int *g_cpu_sort_hist = NULL;            //per worker digit counts, then offsets
+static unsigned int g_cpu_table_size = 0;
+static unsigned int g_cpu_passes = 1;       //table passes per turn, the table is map_size / passes
+static unsigned int g_cpu_pass_shift = SEARCH_SPACE_BITS;
+static unsigned int g_cpu_pass = 0;
+static unsigned int g_cpu_index_bits = 0;
+static uint64 g_cpu_index_mask = 0;
+static unsigned int g_cpu_workers = 0;
+static unsigned int g_cpu_batch = CPU_BATCH_DEFAULT;
+static sha512_birthday_func g_cpu_sha512 = sha512_birthday;
+static unsigned int g_cpu_sha512_lanes = 1;
+static sha512_birthday_ctx g_cpu_sha512_ctx;
+
+static std::atomic<unsigned int> g_cpu_next_hash(0);
+static std::atomic<unsigned int> g_cpu_dropped(0);     //birthdays that found no room
+
+//`size` bytes starting on a cache line, *mem is what to delete[]
+static void *cpu_alloc_lines(size_t size, char **mem)
+{
+    *mem = new (std::nothrow) char[size + CPU_CACHE_LINE];
+    if(*mem == NULL)
+        return NULL;
+    return (void *)(((uintptr_t)*mem + CPU_CACHE_LINE - 1) & ~(uintptr_t)(CPU_CACHE_LINE - 1));
+}
+
+static int cpu_table_init(unsigned int map_size, unsigned int mem_budget)
+{
+    if(map_size == 0 || (map_size & (map_size - 1))){
+        printf("Error: CPU table size %u MB must be a power of two.\n", map_size>>20);
+        return 1;
+    }
+
+    //over budget: pass p inserts only the birthdays whose top bits are p
+    g_cpu_passes = 1;
+    g_cpu_pass_shift = SEARCH_SPACE_BITS;
+    while(mem_budget && map_size > mem_budget && g_cpu_passes < CPU_PASSES_MAX){
+        map_size /= 2;
+        g_cpu_passes *= 2;
+        g_cpu_pass_shift--;
+    }
+    if(g_cpu_passes > 1){
+        printf("[Info] CPU table exceeds the %u MB budget, searching %u passes over %u MB.\n",
+               mem_budget>>20, g_cpu_passes, map_size>>20);
+    }
+
+    size_t buckets = map_size / sizeof(cpu_bucket);
+    g_cpu_index_bits = 0;
+    while((1ULL << g_cpu_index_bits) < buckets)
+        g_cpu_index_bits++;
+    g_cpu_index_mask = buckets - 1;
+
+    if(buckets == 0 || SEARCH_SPACE_BITS - g_cpu_index_bits + NONCE_BITS > 63){
+        printf("Error: CPU table size %u MB is too small.\n", map_size>>20);
+        return 1;
+    }
+
+    if(g_cpu_table == NULL){
+        g_cpu_table = (cpu_bucket *)cpu_alloc_lines(map_size, &g_cpu_table_mem);
+        if(g_cpu_table == NULL){
+            printf("ERROR: Failed to create CPU collision table, size: %u(0x%x) MBytes\n",
+                   map_size>>20, map_size>>20);
+            return 1;
+        }
+        g_cpu_table_size = map_size;
+    }
+
+    printf("[Info] Created CPU collision table, size: %u(0x%x) MBytes, "
+           "%u slots per bucket, %u threads, probe batch %u, %u passes Ok.\n",
+           map_size>>20, map_size>>20, (unsigned int)CPU_BUCKET_SLOTS, g_cpu_workers,
+           g_cpu_batch, g_cpu_passes);
+    return 0;
+}
+
+static int cpu_partition_init(void)
+{
+    //room for the mean, 1/8 more for the spread and every worker's last partial line,
+    //whole lines so every partition starts line aligned
+    unsigned int mean = (1u << NONCE_BITS) / CPU_PARTS;
+    g_cpu_part_cap = mean + mean / 8 + g_cpu_workers * CPU_LINE_RECORDS;
+    if(g_cpu_part_cap >= (1u << CPU_PART_TABLE_BITS) / 2){
+        printf("Error: %u CPU threads are too many for the partition engine.\n", g_cpu_workers);
+        return 1;
+    }
+
+    size_t parts_size = (size_t)CPU_PARTS * g_cpu_part_cap * sizeof(uint64);
+    if(g_cpu_parts == NULL){
+        g_cpu_parts = (uint64 *)cpu_alloc_lines(parts_size, &g_cpu_parts_mem);
+        g_cpu_lines = (cpu_part_lines *)cpu_alloc_lines(g_cpu_workers * sizeof(cpu_part_lines),
+                                                        &g_cpu_lines_mem);
+        if(g_cpu_parts == NULL || g_cpu_lines == NULL){
+            printf("ERROR: Failed to create %u CPU partitions, size: %u MBytes\n",
+                   CPU_PARTS, (unsigned int)(parts_size>>20));
+            return 1;
+        }
+    }
+
+    printf("[Info] Created %u CPU partitions of %u records, size: %u MBytes, "
+           "%u threads Ok. (-s is not used)\n",
+           CPU_PARTS, g_cpu_part_cap, (unsigned int)(parts_size>>20), g_cpu_workers);
+    return 0;
+}
+
+static int cpu_sort_init(void)
+{
+    size_t size = (size_t)CPU_SORT_RECORDS * 2 * (sizeof(uint64) + sizeof(uint32));
+
+    if(g_cpu_sort_hist == NULL){
+        for(int b = 0; b < 2; b++){
+            g_cpu_sort_key[b] = new (std::nothrow) uint64[CPU_SORT_RECORDS];
+            g_cpu_sort_nonce[b] = new (std::nothrow) uint32[CPU_SORT_RECORDS];
+        }
+        g_cpu_sort_hist = new (std::nothrow) unsigned int[g_cpu_workers * CPU_SORT_BUCKETS];
+        if(g_cpu_sort_key[0] == NULL || g_cpu_sort_key[1] == NULL ||
+           g_cpu_sort_nonce[0] == NULL || g_cpu_sort_nonce[1] == NULL || g_cpu_sort_hist == NULL){
+            printf("ERROR: Failed to create CPU sort arrays, size: %u MBytes\n",
+                   (unsigned int)(size>>20));
+            return 1;
+        }
+    }
+
+    printf("[Info] Created CPU sort arrays for %u birthdays, size: %u MBytes, "
+           "%u radix passes, %u threads Ok. (-s is not used)\n",
+           CPU_SORT_RECORDS, (unsigned int)(size>>20), CPU_SORT_PASSES, g_cpu_workers);
+    return 0;
+}
+
+int cpu_miner_init(unsigned int threads, unsigned int map_size, unsigned int batch,
+                   enum cpu_engines engine, unsigned int mem_budget)
+{
+    if(batch == 0 || batch > CPU_BATCH_MAX){
+        printf("Error: CPU probe batch %u must be 1 to %u birthdays.\n", batch, CPU_BATCH_MAX);
+        return 1;
+    }
+    g_cpu_batch = batch;
+    g_cpu_engine = engine;
+
+    g_cpu_workers = threads;
+    if(g_cpu_workers == 0){
+        g_cpu_workers = std::thread::hardware_concurrency();
+        if(g_cpu_workers == 0)
+            g_cpu_workers = 1;
+    }
+
+    g_cpu_sha512 = sha512_birthday_select(&g_cpu_sha512_lanes);
+    printf("[Info] CPU SHA-512 path selected: %s (%u lanes)\n",
+           sha512_mb_name(g_cpu_sha512_lanes), g_cpu_sha512_lanes);
+
+    if(engine == CPU_ENGINE_PARTITION)
+        return cpu_partition_init();
+    if(engine == CPU_ENGINE_SORT)
+        return cpu_sort_init();
+    return cpu_table_init(map_size, mem_budget);
+}
+
+void cpu_miner_cleanup(void)
+{
+    delete[] g_cpu_table_mem;
+    g_cpu_table_mem = NULL;
+    g_cpu_table = NULL;
+    g_cpu_table_size = 0;
+    delete[] g_cpu_parts_mem;
+    g_cpu_parts_mem = NULL;
+    g_cpu_parts = NULL;
+    delete[] g_cpu_lines_mem;
+    g_cpu_lines_mem = NULL;
+    g_cpu_lines = NULL;
+    for(int b = 0; b < 2; b++){
+        delete[] g_cpu_sort_key[b];
+        delete[] g_cpu_sort_nonce[b];
+        g_cpu_sort_key[b] = NULL;
+        g_cpu_sort_nonce[b] = NULL;
+    }
+    delete[] g_cpu_sort_hist;
+    g_cpu_sort_hist = NULL;
+}
+
+/*
+ * Pair the birthday with every stored one of the same tag, so multi-way
+ * collisions give all their pairs, and keep it in the first free slot.
+ * Returns false when the bucket was full and the birthday is dropped.
+ */
+static inline bool cpu_insert_birthday(uint64 birthday, uint32 nonce,
+                                       std::vector<uint32> &found)
+{
+    uint64 entry = CPU_SLOT_VALID
+                 | ((birthday >> g_cpu_index_bits) << NONCE_BITS) | nonce;
+    cpu_slot *bucket = g_cpu_table[birthday & g_cpu_index_mask].slot;
+
+    for(unsigned int s = 0; s < CPU_BUCKET_SLOTS; s++){
+        uint64 old = bucket[s].load(std::memory_order_relaxed);
+        if(old == 0){
+            if(bucket[s].compare_exchange_strong(old, entry, std::memory_order_relaxed))
+                return true;
+            //another worker filled it first, old is now its entry
+        }
+        if(((old ^ entry) >> NONCE_BITS) == 0){ //same valid bit and birthday
+            found.push_back((uint32)old & CPU_NONCE_MASK);
+            found.push_back(nonce);
+        }
+    }
+    return false;
+}
+
+static void cpu_clear_worker(unsigned int id)
+{
+    size_t slice = g_cpu_table_size / g_cpu_workers;
+    size_t begin = slice * id;
+    if(id == g_cpu_workers - 1)
+        slice = g_cpu_table_size - begin;
+    memset((char *)g_cpu_table + begin, 0, slice);
+}
+
+/*
+ * Birthdays are queued g_cpu_batch deep with their bucket prefetched, then
+ * probed together, so the DRAM misses overlap each other and the hashing
+ * of the next batch instead of stalling every insert.
+ */
+typedef struct {
+    uint64 birthday[CPU_BATCH_MAX];
+    uint32 nonce[CPU_BATCH_MAX];
+    unsigned int count;
+} cpu_batch;
+
+static inline unsigned int cpu_probe_batch(cpu_batch *batch, std::vector<uint32> &found)
+{
+    unsigned int dropped = 0;
+    for(unsigned int b = 0; b < batch->count; b++){
+        if(!cpu_insert_birthday(batch->birthday[b], batch->nonce[b], found))
+            dropped++;
+    }
+    batch->count = 0;
+    return dropped;
+}
+
+/* Chunks are a multiple of the lane count, so lanes never run past `last`. */
+static void cpu_search_worker(std::vector<uint32> *found)
+{
+    const unsigned int lanes = g_cpu_sha512_lanes;
+    uint32 nonces[SHA512_MB_MAX_LANES];
+    uint64 digest[SHA512_MB_MAX_LANES * 8];
+    unsigned int dropped = 0;
+    cpu_batch batch;
+    batch.count = 0;
+
+    for(;;){
+        unsigned int first = g_cpu_next_hash.fetch_add(CPU_CHUNK_HASHES);
+        if(first >= CPU_HASHES_PER_TURN)
+            break;
+
+        unsigned int last = first + CPU_CHUNK_HASHES;
+        if(last > CPU_HASHES_PER_TURN)
+            last = CPU_HASHES_PER_TURN;
+
+        for(unsigned int h = first; h < last; h += lanes){
+            for(unsigned int l = 0; l < lanes; l++)
+                nonces[l] = (h + l) * BIRTHDAYS_PER_HASH;
+
+            g_cpu_sha512(&g_cpu_sha512_ctx, nonces, digest);
+
+            for(unsigned int l = 0; l < lanes; l++){
+                for(unsigned int i = 0; i < BIRTHDAYS_PER_HASH; i++){
+                    uint64 birthday = digest[l * 8 + i] >> (64 - SEARCH_SPACE_BITS);
+                    if((birthday >> g_cpu_pass_shift) != g_cpu_pass)
+                        continue;
+                    CPU_PREFETCH(&g_cpu_table[birthday & g_cpu_index_mask]);
+                    batch.birthday[batch.count] = birthday;
+                    batch.nonce[batch.count] = nonces[l] + i;
+                    if(++batch.count == g_cpu_batch)
+                        dropped += cpu_probe_batch(&batch, *found);
+                }
+            }
+        }
+    }
+    dropped += cpu_probe_batch(&batch, *found);
+    g_cpu_dropped += dropped;
+}
+
+//a clear and a search per pass, returns the clear time
+static double cpu_table_turn(std::vector< std::vector<uint32> > &found)
+{
+    std::vector<std::thread> workers;
+    double clear_ms = 0;
+
+    for(unsigned int pass = 0; pass < g_cpu_passes; pass++){
+        std::chrono::high_resolution_clock::time_point t0, t1;
+        t0 = std::chrono::high_resolution_clock::now();
+
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers.push_back(std::thread(cpu_clear_worker, i));
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers[i].join();
+        workers.clear();
+
+        t1 = std::chrono::high_resolution_clock::now();
+        clear_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+        g_cpu_pass = pass;
+        g_cpu_next_hash = 0;
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers.push_back(std::thread(cpu_search_worker, &found[i]));
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers[i].join();
+        workers.clear();
+    }
+    return clear_ms;
+}
+
+static inline unsigned int cpu_stream_line(unsigned int part, const uint64 *line,
+                                           unsigned int records)
+{
+    unsigned int at = g_cpu_part_fill[part].fetch_add(CPU_LINE_RECORDS,
+                                                      std::memory_order_relaxed);
+    if(at + CPU_LINE_RECORDS > g_cpu_part_cap)
+        return records;     //partition full, dropped
+    CPU_STREAM_LINE(g_cpu_parts + (size_t)part * g_cpu_part_cap + at, line);
+    return 0;
+}
+
+static void cpu_scatter_worker(unsigned int id)
+{
+    const unsigned int lanes = g_cpu_sha512_lanes;
+    uint32 nonces[SHA512_MB_MAX_LANES];
+    uint64 digest[SHA512_MB_MAX_LANES * 8];
+    cpu_part_lines *lines = &g_cpu_lines[id];
+    unsigned int dropped = 0;
+
+    memset(lines->count, 0, sizeof(lines->count));
+
+    for(;;){
+        unsigned int first = g_cpu_next_hash.fetch_add(CPU_CHUNK_HASHES);
+        if(first >= CPU_HASHES_PER_TURN)
+            break;
+
+        unsigned int last = first + CPU_CHUNK_HASHES;
+        if(last > CPU_HASHES_PER_TURN)
+            last = CPU_HASHES_PER_TURN;
+
+        for(unsigned int h = first; h < last; h += lanes){
+            for(unsigned int l = 0; l < lanes; l++)
+                nonces[l] = (h + l) * BIRTHDAYS_PER_HASH;
+
+            g_cpu_sha512(&g_cpu_sha512_ctx, nonces, digest);
+
+            for(unsigned int l = 0; l < lanes; l++){
+                for(unsigned int i = 0; i < BIRTHDAYS_PER_HASH; i++){
+                    uint64 birthday = digest[l * 8 + i] >> (64 - SEARCH_SPACE_BITS);
+                    unsigned int part = (unsigned int)(birthday >> (SEARCH_SPACE_BITS - CPU_PART_BITS));
+                    uint64 *line = lines->rec[part];
+
+                    line[lines->count[part]] = CPU_SLOT_VALID
+                        | ((birthday & CPU_PART_KEY_MASK) << NONCE_BITS) | (nonces[l] + i);
+                    if(++lines->count[part] == CPU_LINE_RECORDS){
+                        dropped += cpu_stream_line(part, line, CPU_LINE_RECORDS);
+                        lines->count[part] = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    //partial lines go out padded with invalid records
+    for(unsigned int part = 0; part < CPU_PARTS; part++){
+        unsigned int count = lines->count[part];
+        if(count == 0)
+            continue;
+        memset(&lines->rec[part][count], 0, (CPU_LINE_RECORDS - count) * sizeof(uint64));
+        dropped += cpu_stream_line(part, lines->rec[part], count);
+    }
+    CPU_STREAM_FENCE();
+    g_cpu_dropped += dropped;
+}
+
+/*
+ * Each partition is matched on its own with a small linear probing table
+ * of record indices. Probing walks every record of the same birthday, so
+ * multi-way collisions give all their pairs.
+ */
+static void cpu_match_worker(std::vector<uint32> *found)
+{
+    const unsigned int mask = (1u << CPU_PART_TABLE_BITS) - 1;
+    std::vector<unsigned short> table(1u << CPU_PART_TABLE_BITS);
+
+    for(;;){
+        unsigned int part = g_cpu_next_part.fetch_add(1);
+        if(part >= CPU_PARTS)
+            break;
+
+        const uint64 *rec = g_cpu_parts + (size_t)part * g_cpu_part_cap;
+        unsigned int n = g_cpu_part_fill[part].load(std::memory_order_relaxed);
+        if(n > g_cpu_part_cap)
+            n = g_cpu_part_cap;
+
+        memset(&table[0], 0, table.size() * sizeof(table[0]));
+        for(unsigned int r = 0; r < n; r++){
+            if(!(rec[r] & CPU_SLOT_VALID))
+                continue;
+            uint64 key = rec[r] >> NONCE_BITS;
+            unsigned int h = (unsigned int)key & mask;
+            while(table[h]){
+                uint64 other = rec[table[h] - 1];
+                if((other >> NONCE_BITS) == key){
+                    found->push_back((uint32)other & CPU_NONCE_MASK);
+                    found->push_back((uint32)rec[r] & CPU_NONCE_MASK);
+                }
+                h = (h + 1) & mask;
+            }
+            table[h] = (unsigned short)(r + 1);
+        }
+    }
+}
+
+//birthday of nonce n at key[n], the nonce array is only filled by the first pass
+static void cpu_sort_hash_worker(void)
+{
+    const unsigned int lanes = g_cpu_sha512_lanes;
+    uint32 nonces[SHA512_MB_MAX_LANES];
+    uint64 digest[SHA512_MB_MAX_LANES * 8];
+    uint64 *key = g_cpu_sort_key[0];
+
+    for(;;){
+        unsigned int first = g_cpu_next_hash.fetch_add(CPU_CHUNK_HASHES);
+        if(first >= CPU_HASHES_PER_TURN)
+            break;
+
+        unsigned int last = first + CPU_CHUNK_HASHES;
+        if(last > CPU_HASHES_PER_TURN)
+            last = CPU_HASHES_PER_TURN;
+
+        for(unsigned int h = first; h < last; h += lanes){
+            for(unsigned int l = 0; l < lanes; l++)
+                nonces[l] = (h + l) * BIRTHDAYS_PER_HASH;
+
+            g_cpu_sha512(&g_cpu_sha512_ctx, nonces, digest);
+
+            for(unsigned int l = 0; l < lanes; l++){
+                for(unsigned int i = 0; i < BIRTHDAYS_PER_HASH; i++)
+                    key[nonces[l] + i] = digest[l * 8 + i] >> (64 - SEARCH_SPACE_BITS);
+            }
+        }
+    }
+}
+
+static inline void cpu_sort_slice(unsigned int id, unsigned int *begin, unsigned int *end)
+{
+    unsigned int slice = CPU_SORT_RECORDS / g_cpu_workers;
+    *begin = slice * id;
+    *end = id == g_cpu_workers - 1 ? CPU_SORT_RECORDS : *begin + slice;
+}
+
+static void cpu_sort_count_worker(unsigned int id, unsigned int pass)
+{
+    const uint64 *key = g_cpu_sort_key[pass & 1];
+    const unsigned int shift = pass * CPU_SORT_DIGIT_BITS;
+    unsigned int *hist = g_cpu_sort_hist + id * CPU_SORT_BUCKETS;
+    unsigned int begin, end;
+
+    cpu_sort_slice(id, &begin, &end);
+    memset(hist, 0, CPU_SORT_BUCKETS * sizeof(hist[0]));
+    for(unsigned int r = begin; r < end; r++)
+        hist[(key[r] >> shift) & (CPU_SORT_BUCKETS - 1)]++;
+}
+
+//stable: each worker scatters its slice in order from its offset per digit
+static void cpu_sort_scatter_worker(unsigned int id, unsigned int pass)
+{
+    const uint64 *key = g_cpu_sort_key[pass & 1];
+    const uint32 *nonce = g_cpu_sort_nonce[pass & 1];
+    uint64 *key_out = g_cpu_sort_key[(pass + 1) & 1];
+    uint32 *nonce_out = g_cpu_sort_nonce[(pass + 1) & 1];
+    const unsigned int shift = pass * CPU_SORT_DIGIT_BITS;
+    unsigned int *offset = g_cpu_sort_hist + id * CPU_SORT_BUCKETS;
+    unsigned int begin, end;
+
+    cpu_sort_slice(id, &begin, &end);
+    for(unsigned int r = begin; r < end; r++){
+        unsigned int at = offset[(key[r] >> shift) & (CPU_SORT_BUCKETS - 1)]++;
+        key_out[at] = key[r];
+        nonce_out[at] = pass == 0 ? r : nonce[r];
+    }
+}
+
+/*
+ * A run of equal birthdays belongs to the worker whose slice it starts in,
+ * even when it reaches into the next slice. Every pair of the run is
+ * reported, so an m-way collision gives m*(m-1)/2 pairs.
+ */
+static void cpu_sort_scan_worker(unsigned int id, std::vector<uint32> *found)
+{
+    const uint64 *key = g_cpu_sort_key[CPU_SORT_PASSES & 1];
+    const uint32 *nonce = g_cpu_sort_nonce[CPU_SORT_PASSES & 1];
+    unsigned int begin, end;
+
+    cpu_sort_slice(id, &begin, &end);
+    while(begin > 0 && begin < end && key[begin] == key[begin - 1])
+        begin++;
+
+    for(unsigned int r = begin; r < end; ){
+        unsigned int run = r + 1;
+        while(run < CPU_SORT_RECORDS && key[run] == key[r])
+            run++;
+        for(unsigned int a = r; a < run; a++){
+            for(unsigned int b = a + 1; b < run; b++){
+                found->push_back(nonce[a]);
+                found->push_back(nonce[b]);
+            }
+        }
+        r = run;
+    }
+}
+
+static void cpu_sort_turn(std::vector< std::vector<uint32> > &found)
+{
+    std::vector<std::thread> workers;
+
+    for(unsigned int i = 0; i < g_cpu_workers; i++)
+        workers.push_back(std::thread(cpu_sort_hash_worker));
+    for(unsigned int i = 0; i < g_cpu_workers; i++)
+        workers[i].join();
+    workers.clear();
+
+    for(unsigned int pass = 0; pass < CPU_SORT_PASSES; pass++){
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers.push_back(std::thread(cpu_sort_count_worker, i, pass));
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers[i].join();
+        workers.clear();
+
+        //digit major, worker minor: worker i's records of a digit follow worker i-1's
+        unsigned int sum = 0;
+        for(unsigned int d = 0; d < CPU_SORT_BUCKETS; d++){
+            for(unsigned int i = 0; i < g_cpu_workers; i++){
+                unsigned int count = g_cpu_sort_hist[i * CPU_SORT_BUCKETS + d];
+                g_cpu_sort_hist[i * CPU_SORT_BUCKETS + d] = sum;
+                sum += count;
+            }
+        }
+
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers.push_back(std::thread(cpu_sort_scatter_worker, i, pass));
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers[i].join();
+        workers.clear();
+    }
+
+    for(unsigned int i = 0; i < g_cpu_workers; i++)
+        workers.push_back(std::thread(cpu_sort_scan_worker, i, &found[i]));
+    for(unsigned int i = 0; i < g_cpu_workers; i++)
+        workers[i].join();
+}
+
+int match_birthday_cpu_alg(unsigned int work_num,
+                        unsigned int map_size, const unsigned char* midhash,
+                        unsigned int *nonce_array, unsigned int *found_num)
+{
+    const bool partition = g_cpu_engine == CPU_ENGINE_PARTITION;
+    const bool sort = g_cpu_engine == CPU_ENGINE_SORT;
+    if(partition ? g_cpu_parts == NULL :
+       sort ? g_cpu_sort_hist == NULL :
+       (g_cpu_table == NULL || map_size != g_cpu_table_size * g_cpu_passes)){
+        printf("ERROR: CPU collision table is not ready for %u MBytes.\n", map_size>>20);
+        return 1;
+    }
+
+    std::chrono::high_resolution_clock::time_point t1, tm, t2;
+    std::vector<std::thread> workers;
+    std::vector< std::vector<uint32> > found(g_cpu_workers);
+    double clear_ms = 0;
+
+    if(partition){
+        for(unsigned int p = 0; p < CPU_PARTS; p++)
+            g_cpu_part_fill[p] = 0;
+    }
+
+    t1 = std::chrono::high_resolution_clock::now();
+
+    //schedule and round 0 for this midhash, shared read-only by the workers
+    sha512_birthday_init(&g_cpu_sha512_ctx, midhash);
+
+    g_cpu_next_hash = 0;
+    g_cpu_dropped = 0;
+    if(sort){
+        cpu_sort_turn(found);
+    }
+    else if(partition){
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers.push_back(std::thread(cpu_scatter_worker, i));
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers[i].join();
+        workers.clear();
+
+        tm = std::chrono::high_resolution_clock::now();
+
+        g_cpu_next_part = 0;
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            workers.push_back(std::thread(cpu_match_worker, &found[i]));
+    }
+    else{
+        clear_ms = cpu_table_turn(found);
+    }
+    for(unsigned int i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    t2 = std::chrono::high_resolution_clock::now();
+
+    unsigned int found_cnt = 0;
+    for(unsigned int i = 0; i < g_cpu_workers; i++){
+        for(size_t k = 0; k < found[i].size(); k += 2){
+            if(found_cnt >= MAX_FOUND_IN_TURN){
+                g_total_ignored++;
+                continue;
+            }
+            nonce_array[found_cnt*2] = found[i][k];
+            nonce_array[found_cnt*2 + 1] = found[i][k + 1];
+            found_cnt++;
+        }
+    }
+    *found_num = found_cnt*2;
+
+    if(work_num%g_stat_every_turns==0 && sort){
+        double search_ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        size_t pairs = 0;
+        for(unsigned int i = 0; i < g_cpu_workers; i++)
+            pairs += found[i].size() / 2;
+        printf("[C Stat] hash, sort and scan time %f ms, %.2f M birthdays/s, "
+               "exact: %u pairs ---->\n",
+               search_ms, (double)(1u << NONCE_BITS) / (search_ms * 1000.0), (unsigned int)pairs);
+    }
+    else if(work_num%g_stat_every_turns==0 && partition){
+        double scatter_ms = std::chrono::duration<double, std::milli>(tm - t1).count();
+        double match_ms = std::chrono::duration<double, std::milli>(t2 - tm).count();
+        printf("[C Stat] scatter time %f ms, match time %f ms, %.2f M birthdays/s, "
+               "%u dropped on full partitions ---->\n",
+               scatter_ms, match_ms,
+               (double)(1u << NONCE_BITS) / ((scatter_ms + match_ms) * 1000.0),
+               g_cpu_dropped.load());
+    }
+    else if(work_num%g_stat_every_turns==0){
+        double search_ms = std::chrono::duration<double, std::milli>(t2 - t1).count() - clear_ms;
+        printf("[C Stat] clear time %f ms, search time %f ms, %.2f M birthdays/s, "
+               "probe batch %u, %u passes, %u dropped on full buckets ---->\n",
+               clear_ms, search_ms,
+               (double)(1u << NONCE_BITS) / (search_ms * 1000.0), g_cpu_batch,
+               g_cpu_passes, g_cpu_dropped.load());
+    }
+
+    if(g_dbg_flag){
+        printf("Work %d found val :%d\n", work_num, found_cnt);
+    }
+
+    return 0;
+}
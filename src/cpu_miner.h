@@ -0,0 +1,57 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef CPU_MINER_H
+#define CPU_MINER_H
+
+#define CPU_BATCH_DEFAULT   32  /* birthdays prefetched before they are probed */
+#define CPU_BATCH_MAX       64
+#define CPU_PASSES_MAX      64  /* table engine passes when map_size exceeds the budget */
+
+enum cpu_engines {
+    CPU_ENGINE_TABLE,       /* shared bucket table of -s bytes */
+    CPU_ENGINE_PARTITION,   /* records radix partitioned by birthday, matched per partition */
+    CPU_ENGINE_SORT,        /* all records radix sorted, exact */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Native CPU Momentum search. The whole nonce space is split over
+ * `threads` workers (0 = one per hardware thread) sharing one collision
+ * table of `map_size` bytes (a power of two, like the -s GPU table),
+ * made of cache line buckets. Each worker prefetches the buckets of
+ * `batch` birthdays (1..CPU_BATCH_MAX) before probing them. A map_size
+ * above mem_budget (0 = none) is searched in passes over a smaller table,
+ * each pass keeping the birthdays of one top bits value.
+ * CPU_ENGINE_PARTITION and CPU_ENGINE_SORT ignore map_size and batch,
+ * see cpu_miner.cpp.
+ */
+int  cpu_miner_init(unsigned int threads, unsigned int map_size, unsigned int batch,
+                    enum cpu_engines engine, unsigned int mem_budget);
+void cpu_miner_cleanup(void);
+
+/*
+ * Same contract as match_birthday_gpu_alg(): midhash in, up to
+ * MAX_FOUND_IN_TURN nonce pairs out, *found_num counts nonces (2 per pair).
+ */
+int match_birthday_cpu_alg(unsigned int work_num,
+                        unsigned int map_size, const unsigned char* midhash,
+                        unsigned int *nonce_array, unsigned int *found_num);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !CPU_MINER_H */
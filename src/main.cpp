@@ -13,14 +13,22 @@ Author: Jim Liu
 2013-2014
 */
 
-#include "CL\cl.h"
+#include <CL/cl.h>
 //#include "utils.h"
 #include "sha2.h"
+#include "momentum.h"
+#include "cpu_miner.h"
+#include "sha512_mb.h"
+#include "miner_context.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <malloc.h>
-#include <windows.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
 
 #ifdef _MSC_VER
 #include <intrin.h>
@@ -30,34 +38,20 @@ Author: Jim Liu
 #endif
 
 
-static cl_mem g_inputBuffer = NULL;
-static cl_mem g_result = NULL;
-static cl_mem g_offset = NULL;
-static cl_mem g_matchBuffer = NULL;
-static cl_mem g_midhash = NULL;
-static cl_uint g_device_num = 0;
-cl_context	g_context = NULL;
-cl_command_queue g_cmd_queue = NULL;
-cl_program	g_program = NULL;
-cl_kernel	g_kernel = NULL;
-cl_kernel	g_birthday_kernel = NULL;
-cl_kernel	g_ready_kernel = NULL;
-cl_kernel	g_match_kernel = NULL;
-
 static cl_uint g_platform_num = 0;
-bool g_amd_GPU = false;
-bool g_nv_GPU = false;
 
 unsigned int g_total_found = 0;
 unsigned int g_total_ignored = 0;
 
 //for perf. counters
-#include <Windows.h>
+typedef std::chrono::steady_clock perf_clock;
+
+static double perf_ms(perf_clock::time_point start, perf_clock::time_point stop)
+{
+    return std::chrono::duration<double, std::milli>(stop - start).count();
+}
 
-#define NONCE_BITS 26
 #define MAX_GPU_NUM 32
-#define SEARCH_SPACE_BITS		50
-#define BIRTHDAYS_PER_HASH		8
 #define CACHED_HASHES			(32)
 
 #define NONCE_MASK  (0xffffffffffffffff << (64-SEARCH_SPACE_BITS))
@@ -67,74 +61,289 @@ unsigned int g_total_ignored = 0;
 
 #define CONFLICT_MAP_SIZE	g_conflict_map_size
 #define MATCH_ARRAY_SIZE 0x200000
-#define RESULT_ARRAY_SIZE 2048
-#define MID_HASH_BUF_SIZE (16 * sizeof(uint64_t))
+#define MATCH_PAIRS ((MATCH_ARRAY_SIZE - 2) / 2)    //after the counter dwords
+#define RESULT_ARRAY_SIZE 2048                      //initial, grows on overflow
+#define RESULT_PREFIX_PAIRS 16                      //read back with the header, more take a second read
+#define MID_HASH_BUF_SIZE (sizeof(sha512_birthday_ctx))
 
 #define MAX_MATCH_PAIR_SIZE 0x4FFFF
-#define MAX_FOUND_IN_TURN 128
+
+/*
+Table mode slot: gen(3) | birthday tag(6) | hash number(23), 0 is empty.
+Slots of another generation read as empty, so the table is only cleared
+when the generation wraps, once every 7 turns.
+A turn over P passes takes P generations, so there the tag gives a bit to
+gen: 15 generations, a clear every 15/P turns, about once a turn at P=16.
+Those clears only cover the -s/P pass table, so the bytes cleared per turn,
+-s/15, stay below the single pass -s/7. The 5 bit tag doubles the phase 1
+candidates, which MATCH_PAIRS only holds while the table is lightly loaded:
+about 0.77M at -s 256 MB but 1.19M at 128 MB. Smaller -s keep the 6 bit
+tag and pay the extra clears instead.
+*/
+#define TABLE_HASHES_PER_TURN   ((1 << NONCE_BITS) / BIRTHDAYS_PER_HASH)
+#define TABLE_GEN_BITS          3
+#define TABLE_PASS_GEN_BITS     4
+#define TABLE_PASS_GEN_MIN      (256u << 20)    //-s from which passes take TABLE_PASS_GEN_BITS
+
+/*
+A table larger than the device allows or --mem-budget is searched in up to
+TABLE_PASSES_MAX passes over a table that much smaller, each pass taking
+the birthdays of one top bits value, see TABLE_PASS_BITS in the kernel.
+*/
+#define TABLE_PASSES_MAX        16
+
+/*
+Table mode keeps GPU_TURN_SETS turns in flight. Each turn owns its midhash,
+match and result buffers and the event of its result read; the table is
+shared, the in-order queue and the slot generation keep the turns apart.
+The host validates turn N while the device runs turn N+1.
+*/
+#define GPU_TURN_SETS           2
+
+/*
+Device timing of table turns from the profiling queue. Every command of a
+turn is tagged with its stage; per stage the turn adds up execution time
+(start..end), driver time (queued..submit) and the time spent waiting
+behind earlier commands (submit..start).
+*/
+enum turn_stages { TS_UPLOAD, TS_FILL, TS_PHASE1, TS_PHASE2, TS_READ, TS_NUM };
+static const char *turn_stage_names[TS_NUM] = { "upload", "fill", "phase1", "phase2", "read" };
+
+#define TURN_PROF_EVENTS        (8 + 2*TABLE_PASSES_MAX)    //profiled commands per turn, the read is `done`
+#define TURN_PROF_WINDOW        256     //turns kept for min/avg/p99
+
+typedef struct {
+    float exec[TURN_PROF_WINDOW];       //device ms, ring
+    unsigned int count;                 //turns recorded so far
+} turn_stage_prof;
+
+
+/* host side of a turn set, lives in pinned memory mapped for good */
+typedef struct {
+    sha512_birthday_ctx ctx;            //source of the non-blocking upload
+    cl_uint header[2 + 2*RESULT_PREFIX_PAIRS];  //result read back: phase 1 pairs, collisions, first pairs
+} gpu_turn_host;
+
+typedef struct {
+    cl_mem midhash;
+    cl_mem match;
+    cl_mem result;
+    cl_mem pinned;                      //CL_MEM_ALLOC_HOST_PTR staging of host
+    gpu_turn_host *host;
+    cl_event done;                      //result read back, NULL when idle
+    cl_event prof[TURN_PROF_EVENTS];
+    cl_uint prof_stage[TURN_PROF_EVENTS];
+    cl_uint prof_num;
+    unsigned char midhash_bytes[32];
+    cl_uint result_pairs;               //capacity of result after the header
+    unsigned int work_num;
+    perf_clock::time_point submitted;
+} gpu_turn_set;
+
+
+#define BITMAP_HASHES_PER_TURN  ((1 << NONCE_BITS) / BIRTHDAYS_PER_HASH)
+#define BITMAP_LIST_SIZE        ((BITMAP_HASHES_PER_TURN + 1) * sizeof(cl_uint)) //counter + every hash
+#define BITMAP_FILTER_ROUNDS    4       //phase 4..6 passes at most
+#define BITMAP_ROTATE_STEP      13      //birthday bits rotated per pass
+#define BITMAP_HOST_DOMAIN      1024    //hashes left for the host to resolve
 
 
 
 static unsigned int g_conflict_map_size = 0;
 static unsigned g_group_shift = 20;
-static unsigned g_group_size = 4;
 
 
-enum gpu_algos {
-    AUTO,
-	GEEKJ,		/* GCN*/
-	KISS,		/* CLASSIC*/
-	GEN,
-};
-
 static const char *gpu_algo_names[] = {
-    [AUTO] = "auto",
-	[GEEKJ] = "GeekJ",
+    [AUTO] = "auto",
+	[GEEKJ] = "GeekJ",
 	[KISS] = "Kiss",
 	[GEN] = "gen"
 };
 
+static const char *gpu_mode_names[] = {
+    [MODE_TABLE] = "table",
+    [MODE_BITMAP] = "bitmap"
+};
+
+static const char *device_type_names[] = {
+    [DEVICE_GPU] = "gpu",
+    [DEVICE_CPU] = "cpu",
+    [DEVICE_ACCELERATOR] = "accelerator",
+    [DEVICE_ALL] = "all"
+};
+
+static const cl_device_type device_type_bits[] = {
+    [DEVICE_GPU] = CL_DEVICE_TYPE_GPU,
+    [DEVICE_CPU] = CL_DEVICE_TYPE_CPU,
+    [DEVICE_ACCELERATOR] = CL_DEVICE_TYPE_ACCELERATOR,
+    [DEVICE_ALL] = CL_DEVICE_TYPE_ALL
+};
+
+/* bitmap mode kernels, same order as bitmap_kernel_names */
+enum bitmap_kernels {
+    BK_ZERO,
+    BK_PHASE1,
+    BK_PHASE2,
+    BK_PHASE3,
+    BK_PHASE4,
+    BK_PHASE5,
+    BK_PHASE6,
+    BK_NUM
+};
+
+static const char *bitmap_kernel_names[BK_NUM] = {
+    "zeroBitmap",
+    "birthdayBitmapPhase1",
+    "birthdayPhase2",
+    "birthdayPhase3",
+    "birthdayPhase4",
+    "birthdayPhase5",
+    "birthdayPhase6"
+};
+
+/* same kernels with the bitmap split over two buffers (bitmap, bitmap2) */
+static const char *bitmap_2buf_kernel_names[BK_NUM] = {
+    "_2buf_zeroBitmap",
+    "_2buf_birthdayPhase1",
+    "_2buf_birthdayPhase2",
+    "_2buf_birthdayPhase3",
+    "_2buf_birthdayPhase4",
+    "_2buf_birthdayPhase5",
+    "_2buf_birthdayPhase6"
+};
+
+/*
+Everything one OpenCL device owns, see miner_context.h. The counters are
+atomic so other threads may read them while the owner is mining.
+*/
+struct MinerContext {
+    cl_uint platform_num;               //-p enumeration
+    cl_uint dev_num;                    //-d enumeration within dev_type
+    enum device_types dev_type;         //--device-type
+    cl_context context;
+    cl_command_queue cmd_queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_kernel birthday_kernel;
+    cl_kernel ready_kernel;
+    cl_kernel match_kernel;
+    cl_kernel bitmap_kernels[BK_NUM];
+
+    cl_mem inputBuffer;
+    cl_mem inputBuffer2;                //second half of the bitmap in two-buffer mode
+    cl_mem midhash;
+    cl_mem midhash_pinned;              //bitmap mode staging of midhash_host
+    sha512_birthday_ctx *midhash_host;
+    cl_mem bitmap_list;                 //phase 1/4 colliders, phase 2/5 input
+    cl_mem bitmap_domain[2];            //phase 3/6 output, ping-pong
+    void *bitmap_scratch;               //host domain and birthdays, grown as needed
+    size_t bitmap_scratch_size;
+    cl_uint table_gen;                  //table mode slot generation, 1..table_gen_max
+    cl_uint table_gen_max;              //2^SLOT_GEN_BITS - 1 of the built kernel
+    cl_uint table_passes;               //table mode passes per turn, map_size is -s / passes
+    cl_ulong mem_budget;                //table bytes allowed, 0 for the device limit
+    gpu_turn_set turn_sets[GPU_TURN_SETS];
+    unsigned int turn_seq;              //turn sets are used round robin
+
+    bool turn_prof;                     //cleared when the device gives no timestamps
+    turn_stage_prof stage_prof[TS_NUM];
+
+    bool amd_GPU;
+    bool nv_GPU;
+    bool bitmap_2buf;                   //map size above CL_DEVICE_MAX_MEM_ALLOC_SIZE
+    enum gpu_algos algo;
+    enum gpu_modes gpu_mode;
+    unsigned int map_size;
+    unsigned int work_size;
+    cl_uint vector_width;               //ulong lanes of birthdayPhase1, 2, 4 or 8
+
+    cl_uint result_pairs;               //result capacity for the next turn sets
+    cl_uint *found;                     //nonces of the last turn, 2 per pair
+    unsigned int found_size;            //capacity of found in nonces
+
+    std::atomic<unsigned int> collisions;
+    std::atomic<unsigned int> match_overflow;
+    std::atomic<unsigned int> result_overflow;
+    std::atomic<unsigned int> turns;
+    std::atomic<unsigned long long> busy_us;
+};
+
+static const char *bitmap_kernel_name(MinerContext *ctx, int id)
+{
+    return ctx->bitmap_2buf ? bitmap_2buf_kernel_names[id] : bitmap_kernel_names[id];
+}
+
 
 unsigned g_work_size = 64;
 unsigned g_run_turns = 2;
+bool g_cpu_mode = false;
+unsigned int g_cpu_threads = 0;
+unsigned int g_cpu_batch = CPU_BATCH_DEFAULT;
+enum cpu_engines g_cpu_engine = CPU_ENGINE_TABLE;
+unsigned int g_mem_budget = 0;      //--mem-budget, table bytes for -c and GPU table mode
+
+static const char *cpu_engine_names[] = {
+    [CPU_ENGINE_TABLE] = "table",
+    [CPU_ENGINE_PARTITION] = "partition",
+    [CPU_ENGINE_SORT] = "sort"
+};
 bool g_dbg_flag = false;
 unsigned int g_stat_every_turns = 8;
 enum gpu_algos g_algo = AUTO;
+enum gpu_modes g_gpu_mode = MODE_TABLE;
 
-LARGE_INTEGER g_PerfFrequency;
-LARGE_INTEGER g_PerfCPUStart;
-LARGE_INTEGER g_PerfCPUStop;
-
-LARGE_INTEGER g_PerfTotalStart;
-LARGE_INTEGER g_PerfTotalStop;
-
-LARGE_INTEGER g_PerformanceCountNDRangeStart;
-LARGE_INTEGER g_PerformanceCountNDRangeStop;
 
 
-void Cleanup_OpenCL()
+void Cleanup_OpenCL(MinerContext *ctx)
 {
-    if( g_inputBuffer ) {clReleaseMemObject( g_inputBuffer ); g_inputBuffer = NULL;}
-    //if( g_inputBuffer2 ) {clReleaseMemObject( g_inputBuffer2 ); g_inputBuffer2 = NULL;}
-    if( g_offset ) {clReleaseMemObject( g_offset ); g_offset = NULL;}
-    if( g_midhash ) {clReleaseMemObject( g_midhash ); g_midhash = NULL;}
-    if( g_kernel ) {clReleaseKernel( g_kernel ); g_kernel = NULL;}
-    if( g_birthday_kernel){clReleaseKernel( g_birthday_kernel ); g_birthday_kernel = NULL;}
-    if( g_match_kernel){clReleaseKernel( g_match_kernel ); g_match_kernel = NULL;}
-    if( g_program ) {clReleaseProgram( g_program ); g_program = NULL;}
-    if( g_cmd_queue ) {clReleaseCommandQueue( g_cmd_queue ); g_cmd_queue = NULL;}
-    if( g_context ) {clReleaseContext( g_context ); g_context = NULL;}
+    if( ctx->inputBuffer ) {clReleaseMemObject( ctx->inputBuffer ); ctx->inputBuffer = NULL;}
+    if( ctx->inputBuffer2 ) {clReleaseMemObject( ctx->inputBuffer2 ); ctx->inputBuffer2 = NULL;}
+
+    if( ctx->midhash ) {clReleaseMemObject( ctx->midhash ); ctx->midhash = NULL;}
+    if( ctx->midhash_pinned ) {
+        clEnqueueUnmapMemObject( ctx->cmd_queue, ctx->midhash_pinned, ctx->midhash_host, 0, NULL, NULL );
+        clReleaseMemObject( ctx->midhash_pinned ); ctx->midhash_pinned = NULL; ctx->midhash_host = NULL;
+    }
+    for(int i = 0; i < GPU_TURN_SETS; i++){
+        gpu_turn_set *set = &ctx->turn_sets[i];
+        if( set->done ) {clWaitForEvents(1, &set->done); clReleaseEvent( set->done ); set->done = NULL;}
+        for(cl_uint k = 0; k < set->prof_num; k++){
+            if( set->prof[k] ) clReleaseEvent( set->prof[k] );
+        }
+        set->prof_num = 0;
+        if( set->midhash ) {clReleaseMemObject( set->midhash ); set->midhash = NULL;}
+        if( set->match ) {clReleaseMemObject( set->match ); set->match = NULL;}
+        if( set->result ) {clReleaseMemObject( set->result ); set->result = NULL;}
+        if( set->pinned ) {
+            clEnqueueUnmapMemObject( ctx->cmd_queue, set->pinned, set->host, 0, NULL, NULL );
+            clReleaseMemObject( set->pinned ); set->pinned = NULL; set->host = NULL;
+        }
+    }
+    if( ctx->bitmap_list ) {clReleaseMemObject( ctx->bitmap_list ); ctx->bitmap_list = NULL;}
+    for(int i = 0; i < 2; i++){
+        if( ctx->bitmap_domain[i] ) {clReleaseMemObject( ctx->bitmap_domain[i] ); ctx->bitmap_domain[i] = NULL;}
+    }
+    for(int i = 0; i < BK_NUM; i++){
+        if( ctx->bitmap_kernels[i] ) {clReleaseKernel( ctx->bitmap_kernels[i] ); ctx->bitmap_kernels[i] = NULL;}
+    }
+    if( ctx->kernel ) {clReleaseKernel( ctx->kernel ); ctx->kernel = NULL;}
+    if( ctx->birthday_kernel){clReleaseKernel( ctx->birthday_kernel ); ctx->birthday_kernel = NULL;}
+    if( ctx->match_kernel){clReleaseKernel( ctx->match_kernel ); ctx->match_kernel = NULL;}
+    if( ctx->program ) {clReleaseProgram( ctx->program ); ctx->program = NULL;}
+    if( ctx->cmd_queue ) {clReleaseCommandQueue( ctx->cmd_queue ); ctx->cmd_queue = NULL;}
+    if( ctx->context ) {clReleaseContext( ctx->context ); ctx->context = NULL;}
+    ctx->table_gen = 0; //a new table buffer starts uninitialized
 }
 
 const char* getclErrString(cl_int errcode);
 
 
 
-static cl_platform_id pPlatforms[10] = { 0 };
 const char* getclErrString(cl_int errcode);
 
 cl_platform_id GetOCLPlatform(const cl_uint platform_num)
 {
+    cl_platform_id pPlatforms[10] = { 0 };
     char pPlatformName[256] = { 0 };
 
     cl_uint uiPlatformsCount = 0;
@@ -171,6 +380,83 @@ cl_platform_id GetOCLPlatform(const cl_uint platform_num)
     return NULL;
 }
 
+/*
+--sub-devices N splits every device into N sub-devices of equal compute
+units (clCreateSubDevices), which then count as devices of their own for
+-d and --list-devices. A CPU OpenCL runtime so drives several device
+workers on a machine without GPUs. Each device is split once and its
+sub-devices are kept for the process.
+*/
+#define SUB_DEVICES_MAX 16
+
+typedef struct {
+    cl_device_id parent;
+    cl_device_id subs[SUB_DEVICES_MAX];
+    cl_uint num;                        //0 when the device could not be split
+} sub_device_split;
+
+static unsigned int g_sub_devices = 0;
+static sub_device_split g_splits[MAX_GPU_NUM];
+static unsigned int g_split_count = 0;
+
+static const sub_device_split *SplitOCLDevice(cl_device_id device)
+{
+    for(unsigned int i = 0; i < g_split_count; i++){
+        if(g_splits[i].parent == device)
+            return &g_splits[i];
+    }
+    if(g_split_count == MAX_GPU_NUM){
+        return NULL;
+    }
+
+    sub_device_split *split = &g_splits[g_split_count++];
+    split->parent = device;
+    split->num = 0;
+
+    cl_uint units = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+    cl_device_partition_property props[3] = {
+        CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(units / g_sub_devices), 0
+    };
+    cl_int err = units >= g_sub_devices ?
+        clCreateSubDevices(device, props, g_sub_devices, split->subs, &split->num) : CL_INVALID_VALUE;
+    if(err != CL_SUCCESS){
+        printf("WARNING[%d]: Failed to split a %u compute unit device into %u sub-devices,"
+               " using it whole. (%s)\n", err, units, g_sub_devices, getclErrString(err));
+        split->num = 0;
+    }
+    return split;
+}
+
+//devices of one type in platform order, which is what dev_num counts
+static cl_uint GetOCLDevices(cl_platform_id platform, enum device_types dev_type,
+                             cl_device_id *devices)
+{
+    cl_uint num = 0;
+    cl_int err = clGetDeviceIDs(platform, device_type_bits[dev_type], MAX_GPU_NUM, devices, &num);
+    if(err != CL_SUCCESS){  //CL_DEVICE_NOT_FOUND when the type has none
+        return 0;
+    }
+    num = num < MAX_GPU_NUM ? num : MAX_GPU_NUM;
+    if(g_sub_devices < 2){
+        return num;
+    }
+
+    cl_device_id roots[MAX_GPU_NUM];
+    memcpy(roots, devices, num * sizeof(cl_device_id));
+    cl_uint count = 0;
+    for(cl_uint i = 0; i < num && count < MAX_GPU_NUM; i++){
+        const sub_device_split *split = SplitOCLDevice(roots[i]);
+        if(split == NULL || split->num == 0){
+            devices[count++] = roots[i];
+            continue;
+        }
+        for(cl_uint s = 0; s < split->num && count < MAX_GPU_NUM; s++)
+            devices[count++] = split->subs[s];
+    }
+    return count;
+}
+
 void BuildFailLog( cl_program program,
                   cl_device_id device_id )
 {
@@ -241,7 +527,7 @@ char *ReadSources(const char *fileName)
 }
 
 
-extern "C" int Setup_OpenCL( const char *program_source,
+extern "C" int Setup_OpenCL(MinerContext *ctx, const char *program_source,
                 cl_uint* alignment,
                  const unsigned int map_size,
                  unsigned int vector_width,
@@ -249,32 +535,178 @@ extern "C" int Setup_OpenCL( const char *program_source,
                  const unsigned int platform_num,
                  const unsigned int dev_num);
 
-int Setup_OpenCL(const char *program_source, cl_uint* alignment,
+/*
+Kernel binary cache: mom_<key>.bin in the working directory. The key is a
+sha256 of platform, device, driver version, kernel source and build options,
+so any change to those misses the cache and builds from source again.
+*/
+bool GetBinaryFileName(char *fileName, size_t size, cl_platform_id platform,
+                       cl_device_id device, const char *sources, const char *options)
+{
+    char info[4][256];
+    cl_int err = CL_SUCCESS;
+
+    memset(info, 0, sizeof(info));
+    err |= clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(info[0]) - 1, info[0], NULL);
+    err |= clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(info[1]) - 1, info[1], NULL);
+    err |= clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(info[2]) - 1, info[2], NULL);
+    err |= clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(info[3]) - 1, info[3], NULL);
+    if (err != CL_SUCCESS){
+        printf("WARNING[%d]: Failed to get device info, ocl binary cache disabled.\n", err);
+        return false;
+    }
+
+    //keep the terminating zeros so fields can not run into each other
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    for(int i = 0; i < 4; i++){
+        sha256_update(&ctx, (const unsigned char *)info[i], strlen(info[i]) + 1);
+    }
+    sha256_update(&ctx, (const unsigned char *)sources, strlen(sources) + 1);
+    sha256_update(&ctx, (const unsigned char *)options, strlen(options) + 1);
+    sha256_final(&ctx, digest);
+
+    if(size < sizeof("mom_.bin") + 32){
+        return false;
+    }
+    strcpy(fileName, "mom_");
+    for(int i = 0; i < 16; i++){
+        sprintf(fileName + 4 + 2*i, "%02x", digest[i]);
+    }
+    strcat(fileName, ".bin");
+    return true;
+}
+
+bool LoadProgramBinary(MinerContext *ctx, const char *fileName, cl_device_id device, const char *options)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (!file){
+        return false; //not cached yet
+    }
+
+    long size = 0;
+    unsigned char *binary = NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0){
+        rewind(file);
+        binary = (unsigned char *)malloc(size);
+        if (binary && fread(binary, 1, size, file) != (size_t)size){
+            free(binary);
+            binary = NULL;
+        }
+    }
+    fclose(file);
+
+    if (binary == NULL){
+        printf("WARNING: Failed to read ocl binary file '%s'.\n", fileName);
+        return false;
+    }
+
+    cl_int err = CL_SUCCESS;
+    cl_int status = CL_SUCCESS;
+    size_t binarySize = size;
+    ctx->program = clCreateProgramWithBinary(ctx->context, 1, &device, &binarySize,
+                                          (const unsigned char **)&binary, &status, &err);
+    free(binary);
+
+    if (CL_SUCCESS == err && CL_SUCCESS == status){
+        err = clBuildProgram(ctx->program, 1, &device, options, NULL, NULL);
+    }
+    else if (CL_SUCCESS == err){
+        err = status;
+    }
+
+    if (CL_SUCCESS != err){
+        printf("[Info] Cached ocl binary file '%s' rejected (%s), rebuilding.\n",
+               fileName, getclErrString(err));
+        if (ctx->program) {clReleaseProgram( ctx->program ); ctx->program = NULL;}
+        return false;
+    }
+
+    printf("[Info] Loaded ocl binary file '%s'.\n", fileName);
+    return true;
+}
+
+//written to a temp file first, a crash mid-write must not leave a bad cache
+void SaveProgramBinary(MinerContext *ctx, const char *fileName)
+{
+    cl_int err = CL_SUCCESS;
+    //洢õkernelļ
+    char **binaries = (char **)malloc( sizeof(char *) * 1 ); //ֻһ豸
+    size_t *binarySizes = (size_t*)malloc( sizeof(size_t) * 1 );
+
+    err = clGetProgramInfo(ctx->program,
+        CL_PROGRAM_BINARY_SIZES,
+        sizeof(size_t) * 1,
+        binarySizes, NULL);
+
+    if (CL_SUCCESS != err){
+        printf("WARNING[%d]: Failed to get program bin size ...(%s)\n",
+               err, getclErrString(err));
+    }
+    else{
+        binaries[0] = (char *)malloc( sizeof(unsigned char) * binarySizes[0]);
+        err = clGetProgramInfo(ctx->program,
+            CL_PROGRAM_BINARIES,
+            sizeof(char *) * 1,
+            binaries,
+            NULL);
+
+        if (CL_SUCCESS != err){
+            printf("WARNING[%d]: Failed to get program binaray ...(%s)\n",
+                   err, getclErrString(err));
+        }
+        else{
+            char tmpname[256];
+            snprintf(tmpname, sizeof(tmpname), "%s.tmp", fileName);
+            FILE *file = fopen(tmpname, "wb");
+            if (file && fwrite(binaries[0], 1, binarySizes[0], file) == binarySizes[0] &&
+                fclose(file) == 0){
+                file = NULL;
+                remove(fileName);
+                if (rename(tmpname, fileName) != 0){
+                    printf("WARNING: Failed to save ocl binary file '%s'.\n", fileName);
+                    remove(tmpname);
+                }
+            }
+            else{
+                printf("WARNING: Failed to write ocl binary file '%s'.\n", tmpname);
+                if (file) fclose(file);
+                remove(tmpname);
+            }
+        }
+        free(binaries[0]);
+    }
+    free(binaries);
+    free(binarySizes);
+}
+
+int Setup_OpenCL(MinerContext *ctx, const char *program_source, cl_uint* alignment,
                  const unsigned int map_size,
                  const unsigned int gpu_algo,
                  const unsigned int platform_num, const unsigned int dev_num,
                  const int is_output_build_log)
 {
-    g_conflict_map_size = map_size;
-    g_algo = AUTO;
+    ctx->map_size = map_size;
+    ctx->algo = AUTO;
 
     switch(gpu_algo){
     case 0:
-        g_algo = AUTO;
+        ctx->algo = AUTO;
         break;
     case 1:
-        g_algo = GEEKJ;
+        ctx->algo = GEEKJ;
         break;
     case 2:
-        g_algo = KISS;
+        ctx->algo = KISS;
         break;
     case 3:
-        g_algo = GEN;
+        ctx->algo = GEN;
         break;
     }
 
-    g_group_size = 4;
-    g_device_num = dev_num;
+    ctx->platform_num = platform_num;
+    ctx->dev_num = dev_num;
 
     cl_device_id devices[MAX_GPU_NUM];
     //cl_uint size_ret = 0;
@@ -300,33 +732,26 @@ int Setup_OpenCL(const char *program_source, cl_uint* alignment,
                 (cl_context_properties)ocl_platform_id, 1 };
                 */
 
-    cl_uint             numDevices = 0;
-    cl_uint             numGPUDevices = 0;
-
-    clGetDeviceIDs(ocl_platform_id, CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices);
-    if(numDevices == 0)    //no GPU available.
+    const char *type_name = device_type_names[ctx->dev_type];
+    cl_uint numTypeDevices = GetOCLDevices(ocl_platform_id, ctx->dev_type, devices);
+    if(numTypeDevices == 0)
     {
-        puts("Error: No any GPU devices available in platform! Only GPU is supported now.\n");
+        printf("Error: No %s devices available in platform %d, "
+               "see --list-devices for the others.\n", type_name, platform_num);
         return 1;
     }
-    else{
-        err = clGetDeviceIDs(ocl_platform_id, CL_DEVICE_TYPE_GPU, numDevices,
-                             devices, &numGPUDevices);
-        if (err != CL_SUCCESS) {
-            printf("ERROR[%d]: Failed to get GPU device's ids . (%s) \n",
-               err, getclErrString(err));
-        return -1;
-       }
-       printf("The MAX number of available GPU devices is: %u\n", numGPUDevices);
-    }
+    printf("The MAX number of available %s devices is: %u\n", type_name, numTypeDevices);
 
-    if(dev_num >= numGPUDevices){
-       printf("Error: Selected GPU device num: %u exeed available GPU devices number %d,"
-              " selected correct device or check GPUs by clinfo for more help.\n",
-              dev_num, numGPUDevices);
+    if(dev_num >= numTypeDevices){
+       printf("Error: Selected %s device num: %u exeed available %s devices number %d,"
+              " selected correct device or check them by --list-devices for more help.\n",
+              type_name, dev_num, type_name, numTypeDevices);
        return -1;
     }
 
+    cl_device_type dev_type_bits = 0;
+    clGetDeviceInfo(devices[dev_num], CL_DEVICE_TYPE, sizeof(dev_type_bits), &dev_type_bits, NULL);
+
 
     char dev_name[512];
     err = clGetDeviceInfo (devices[dev_num],
@@ -338,7 +763,7 @@ int Setup_OpenCL(const char *program_source, cl_uint* alignment,
     if (CL_SUCCESS != err){
                 printf("Error[%d]: Failed to get platform %d device %d name info ...(%s)\n",
                        err, platform_num, dev_num, getclErrString(err));
-                Cleanup_OpenCL();
+                Cleanup_OpenCL(ctx);
                 return -1;
     }
     else{
@@ -355,16 +780,42 @@ int Setup_OpenCL(const char *program_source, cl_uint* alignment,
     if (CL_SUCCESS != err){
                 printf("Error[%d]: Failed to get platform %d device %d max mem alloc info ...(%s)\n",
                        err, platform_num, dev_num, getclErrString(err));
-                Cleanup_OpenCL();
+                Cleanup_OpenCL(ctx);
                 return -1;
     }
     else{
         printf("Device max alloc memory size: %d MB\n", max_dev_mem_alloc>>20);
-        if(g_conflict_map_size > max_dev_mem_alloc){
-           printf("Error: Platform %d device %d max allocated %d MB memory exceed limit. \n",
-                        platform_num, dev_num, g_conflict_map_size>>20);
-           Cleanup_OpenCL();
-           return -1;
+
+        //table mode trades hashing for memory instead of giving up or switching mode.
+        //An -s that TABLE_PASSES_MAX passes cannot fit is left whole for the checks below
+        ctx->table_passes = 1;
+        if(ctx->gpu_mode == MODE_TABLE && map_size / TABLE_PASSES_MAX <= max_dev_mem_alloc){
+            cl_ulong budget = max_dev_mem_alloc;
+            if(ctx->mem_budget && ctx->mem_budget < budget)
+                budget = ctx->mem_budget;
+            while(ctx->map_size > budget && ctx->table_passes < TABLE_PASSES_MAX){
+                ctx->map_size /= 2;
+                ctx->table_passes *= 2;
+            }
+            if(ctx->table_passes > 1){
+                printf("[Info] %d MB table exceeds the %d MB budget, "
+                       "searching %u passes over a %d MB table.\n",
+                       map_size>>20, (unsigned int)(budget>>20), ctx->table_passes,
+                       ctx->map_size>>20);
+            }
+        }
+
+        if(ctx->map_size > max_dev_mem_alloc){
+           if(ctx->map_size/2 > max_dev_mem_alloc){
+               printf("Error: Platform %d device %d max allocated %d MB memory exceed limit. \n",
+                            platform_num, dev_num, ctx->map_size>>20);
+               Cleanup_OpenCL(ctx);
+               return -1;
+           }
+           ctx->bitmap_2buf = true;
+           ctx->gpu_mode = MODE_BITMAP;
+           printf("[Info] %d MB map exceeds the max allocation, "
+                  "using two-buffer bitmap kernels.\n", ctx->map_size>>20);
         }
     }
 
@@ -378,13 +829,30 @@ int Setup_OpenCL(const char *program_source, cl_uint* alignment,
     if (CL_SUCCESS != err){
                 printf("Error[%d]: Failed to get platform %d device %d max global mem info ...(%s)\n",
                        err, platform_num, dev_num, getclErrString(err));
-                Cleanup_OpenCL();
+                Cleanup_OpenCL(ctx);
                 return -1;
     }
     else{
         printf("Device max global memory size: %d MB\n", max_dev_gbl_mem>>20);
     }
 
+    //hashes per birthdayPhase1 work item, 2 unless the device asks for wider ulong vectors
+    cl_uint pref_vec_long = 0;
+    err = clGetDeviceInfo (devices[dev_num],
+            CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG ,
+            sizeof(pref_vec_long),
+            &pref_vec_long,
+            NULL);
+    ctx->vector_width = 2;
+    if (CL_SUCCESS == err && pref_vec_long >= 8){
+        ctx->vector_width = 8;
+    }
+    else if (CL_SUCCESS == err && pref_vec_long >= 4){
+        ctx->vector_width = 4;
+    }
+    printf("Device preferred long vector width: %u, birthday kernel uses ulong%u\n",
+           pref_vec_long, ctx->vector_width);
+
 
 
 
@@ -394,28 +862,28 @@ int Setup_OpenCL(const char *program_source, cl_uint* alignment,
     props[1] = (cl_context_properties)ocl_platform_id;  // platform is of type cl_platform_id
     props[2] = (cl_context_properties)0;   // last element must be 0
 
-   // g_context = clCreateContextFromType(props, CL_DEVICE_TYPE_GPU, NULL, NULL, &err);
-    g_context = clCreateContext(props, 1, &devices[dev_num], NULL, NULL, &err);
+   // ctx->context = clCreateContextFromType(props, CL_DEVICE_TYPE_GPU, NULL, NULL, &err);
+    ctx->context = clCreateContext(props, 1, &devices[dev_num], NULL, NULL, &err);
     if (err != CL_SUCCESS) {
-        printf("ERROR[%d]: Failed to create context from selected platform: %d GPU device. (%s) \n",
-               err, platform_num, getclErrString(err));
+        printf("ERROR[%d]: Failed to create context from selected platform: %d %s device. (%s) \n",
+               err, platform_num, type_name, getclErrString(err));
         return -1;
     }
-    /*if (g_context == (cl_context)0)
+    /*if (ctx->context == (cl_context)0)
         return -1;*/
 
 
     // get the list of CPU devices associated with context
     cl_device_id selected_devices[MAX_GPU_NUM];
     size_t cb;
-    err = clGetContextInfo(g_context, CL_CONTEXT_DEVICES, 0, NULL, &cb);
+    err = clGetContextInfo(ctx->context, CL_CONTEXT_DEVICES, 0, NULL, &cb);
     if (err != CL_SUCCESS) {
         printf("ERROR[%d]: Failed to get context device number from platform: %d GPU device. (%s) \n",
                err, platform_num, getclErrString(err));
         return -1;
     }
 
-    err = clGetContextInfo(g_context, CL_CONTEXT_DEVICES, cb, selected_devices, NULL);
+    err = clGetContextInfo(ctx->context, CL_CONTEXT_DEVICES, cb, selected_devices, NULL);
     if (err != CL_SUCCESS) {
         printf("ERROR[%d]: Failed to get context device info from platform: %d GPU device. (%s) \n",
                err, platform_num, getclErrString(err));
@@ -445,20 +913,28 @@ int Setup_OpenCL(const char *program_source, cl_uint* alignment,
     if (CL_SUCCESS != err){
                 printf("Error[%d]: Failed to get platform %d device %d info ...(%s)\n",
                        err, platform_num, dev_num, getclErrString(err));
-                Cleanup_OpenCL();
+                Cleanup_OpenCL(ctx);
                 return -1;
     }
     else{
             if(strstr(ext_info, "cl_khr_global_int32_base_atomics") == NULL){
                 printf("Error: This device %d opencl version is too old, can not be supported.\n", dev_num);
-                Cleanup_OpenCL();
+                Cleanup_OpenCL(ctx);
                 return -1;
             }
 
-            if(g_algo == AUTO){
+            //GEEKJ and KISS only add their build options on AMD GPUs, not the AMD CPU runtime
+            ctx->amd_GPU = (dev_type_bits & CL_DEVICE_TYPE_GPU) &&
+                           strstr(ext_info, "cl_amd") != NULL;
+
+            if(ctx->algo == AUTO){
                 printf("[Info] Auto detect and specify GPU algorithm ...  ");
-                g_algo = GEN;
-                if(strstr(ext_info, "cl_amd")){
+                ctx->algo = GEN;
+                if(!(dev_type_bits & CL_DEVICE_TYPE_GPU)){
+                    printf("Non GPU device detected: "
+                           "Selected algorithm '%s'\n", gpu_algo_names[ctx->algo] );
+                }
+                else if(ctx->amd_GPU){
                     if(g_dbg_flag){
                         printf("--------+++-------> AMD GPU detected.\n");
                     }
@@ -468,191 +944,194 @@ int Setup_OpenCL(const char *program_source, cl_uint* alignment,
                        strstr(dev_name, "Pitcairn") ||
                        /*strstr(dev_name, "Bonaire ") || // fix here, 7790 not suitable GeekJ*/
                        strstr(dev_name, "Verde")){
-                        g_algo = GEEKJ;
+                        ctx->algo = GEEKJ;
                         printf("AMD Southern Islands 28nm GCN GPU  detected: "
-                               "Selected algorithm '%s'\n", gpu_algo_names[g_algo] );
+                               "Selected algorithm '%s'\n", gpu_algo_names[ctx->algo] );
 
                     }
                     else{
-                        g_algo = KISS;
+                        ctx->algo = KISS;
                         printf("AMD classic >= 40 nm GPU detected: "
-                               "Selected algorithm '%s'\n", gpu_algo_names[g_algo] );
+                               "Selected algorithm '%s'\n", gpu_algo_names[ctx->algo] );
                         printf("[Info] Please compare with algorithm "
                                "'GeekJ' for the best perfomance!!\n" );
                     }
                 }
 
-                if(strstr(ext_info, "cl_nv")){
-                    g_algo = GEN;
+                if((dev_type_bits & CL_DEVICE_TYPE_GPU) && strstr(ext_info, "cl_nv")){
+                    ctx->algo = GEN;
                     //printf("Error: A device %d is not supported.\n", dev_num);
                     //Cleanup_OpenCL();
-                    g_nv_GPU = true;
+                    ctx->nv_GPU = true;
                     if(g_dbg_flag){
                         printf("--------___--------> Nvidia GPU detected.\n");
                     }
                     printf("Nvidia GPU detected: "
-                               "Selected algorithm '%s'\n", gpu_algo_names[g_algo] );
+                               "Selected algorithm '%s'\n", gpu_algo_names[ctx->algo] );
 
                 }
 
-                if(strstr(ext_info, "intel")){
-                    g_algo = GEN;
+                if((dev_type_bits & CL_DEVICE_TYPE_GPU) && strstr(ext_info, "intel")){
+                    ctx->algo = GEN;
                     //printf("Error: A device %d is not supported.\n", dev_num);
                     //Cleanup_OpenCL();
                     if(g_dbg_flag){
                         printf("--------:)--------> Intel GPU detected.\n");
                     }
                     printf("Intel GPU detected: "
-                               "Selected algorithm '%s'\n", gpu_algo_names[g_algo] );
+                               "Selected algorithm '%s'\n", gpu_algo_names[ctx->algo] );
 
                 }
             }else{
-                printf("[Waring] Custom GPU algorithm selected '%s', maybe unstable!\n", gpu_algo_names[g_algo] );
+                printf("[Waring] Custom GPU algorithm selected '%s', maybe unstable!\n", gpu_algo_names[ctx->algo] );
 
             }
     }
 
 
-    g_cmd_queue = clCreateCommandQueue(g_context, devices[dev_num], 0, &err);
+    //timestamps for the per stage report, see TurnProfReport()
+    ctx->cmd_queue = clCreateCommandQueue(ctx->context, devices[dev_num], CL_QUEUE_PROFILING_ENABLE, &err);
     if( CL_SUCCESS != err){
         printf("Error[%d]: Failed to create CommandQueue on platform %d device %d.(%s)\n",
                 err, platform_num, dev_num, getclErrString(err));
-        Cleanup_OpenCL();
+        Cleanup_OpenCL(ctx);
         return -1;
     }
 
 
     char *sources = NULL;
+    char binfilename[128] = "";
+    char CompilerOptions[1024];
+
+    sources = ReadSources(program_source);
+    if( NULL == sources ){
+        printf("ERROR: Failed to read sources into memory :-( ...\n");
+        Cleanup_OpenCL(ctx);
+        return -1;
+    }
+
+    unsigned int look_up_bits = 0;
+    while((4u << look_up_bits) < ctx->map_size)
+        look_up_bits++;
+    unsigned int pass_bits = 0;
+    while((1u << pass_bits) < ctx->table_passes)
+        pass_bits++;
+    bool wide_gen = pass_bits && (cl_ulong)ctx->map_size * ctx->table_passes >= TABLE_PASS_GEN_MIN;
+    unsigned int gen_bits = wide_gen ? TABLE_PASS_GEN_BITS : TABLE_GEN_BITS;
+    ctx->table_gen_max = (1u << gen_bits) - 1;
+
+    sprintf(CompilerOptions, " -D LOOK_UP_MASK=%d -D LOOK_UP_BITS=%u "
+            " -D BITMAP_INDEX_TYPE=uint64_t -D BITMAP_SIZE=%d -D MATCH_ARRAY_SIZE=%d "
+            " -D BDAY_VEC_WIDTH=%u -D TABLE_PASS_BITS=%u -D SLOT_GEN_BITS=%u ",
+             (ctx->map_size-1)>>2, look_up_bits, ctx->map_size, MATCH_ARRAY_SIZE,
+             ctx->vector_width, pass_bits, gen_bits);
+
+    switch(ctx->algo){
+            case GEEKJ: /*AMD GCN optimization here*/
+                if(ctx->amd_GPU){
+                   char CompilerOptions2[512];
+                   sprintf(CompilerOptions2,
+                           " -D AMD_OPTIM ");
+                   strncat(CompilerOptions, CompilerOptions2, sizeof(CompilerOptions));
+                }
+                break;
+            case KISS: /*AMD classic optimization*/
+                 if(ctx->amd_GPU){
+                   char CompilerOptions2[512];
+                   sprintf(CompilerOptions2,
+                           " -D AMD_OPTIM2 ");
+                   strncat(CompilerOptions, CompilerOptions2, sizeof(CompilerOptions));
+                }
+                break;
+            default:
+                break;
+        }
 
 
+        if(ctx->nv_GPU){
+           strncat(CompilerOptions, " -D NVPU ", sizeof(CompilerOptions));
+        }
+
+#ifdef OCL_DBG
+        if(g_dbg_flag){
+            strncat(CompilerOptions, " -D DEBUG_MODE ", sizeof(CompilerOptions));
+            printf("CompilerOptions: %s\n", CompilerOptions);
+        }
+#endif
+
     bool ret = false; //load bin
 
-    //TODO: Add bin format support here
-    //snprintf(binfilename, sizeof(binfilename), "mom_p%d_d%d.bin", platform_num, dev_num );
+    if(GetBinaryFileName(binfilename, sizeof(binfilename), ocl_platform_id,
+                         devices[dev_num], sources, CompilerOptions)){
+        ret = LoadProgramBinary(ctx, binfilename, devices[dev_num], CompilerOptions);
+    }
 
     if(!ret){
         //printf("[Info] Can not find ocl binary file.\n");
         //exit(9);
         //printf("[Info] Can not load ocl binary file for a faster starting, load source instead.\n");
 
-        char *sources = NULL;
-
-        sources = ReadSources(program_source);
-        if( NULL == sources ){
-            printf("ERROR: Failed to read sources into memory :-( ...\n");
-            Cleanup_OpenCL();
-            return -1;
-        }
-
         printf("[Waiting tip] Please wait for building ocl kernel source code, maybe 30 seconds more...\n");
-        //printf("             Building result will be cached in binary file: %s\n", binfilename);
+        if(binfilename[0]){
+            printf("             Building result will be cached in binary file: %s\n", binfilename);
+        }
 
-        g_program = clCreateProgramWithSource(g_context, 1, (const char**)&sources, NULL, &err);
+        ctx->program = clCreateProgramWithSource(ctx->context, 1, (const char**)&sources, NULL, &err);
         if (CL_SUCCESS != err)
         {
             printf("ERROR[%d]: Failed to create Program with source...\n", err);
-            Cleanup_OpenCL();
+            Cleanup_OpenCL(ctx);
             free(sources);
             return -1;
         }
 
-        char CompilerOptions[1024];
-        sprintf(CompilerOptions, " -D LOOK_UP_MASK=%d "
-                " -D BITMAP_INDEX_TYPE=uint64_t -D BITMAP_SIZE=%d ",
-                 (g_conflict_map_size-1)>>2, g_conflict_map_size);
-
-        switch(g_algo){
-                case GEEKJ: /*AMD GCN optimization here*/
-                    if(g_amd_GPU){
-                       char CompilerOptions2[512];
-                       sprintf(CompilerOptions2,
-                               " -D AMD_OPTIM ");
-                       strncat(CompilerOptions, CompilerOptions2, sizeof(CompilerOptions));
-                    }
-                    break;
-                case KISS: /*AMD classic optimization*/
-                     if(g_amd_GPU){
-                       char CompilerOptions2[512];
-                       sprintf(CompilerOptions2,
-                               " -D AMD_OPTIM2 ");
-                       strncat(CompilerOptions, CompilerOptions2, sizeof(CompilerOptions));
-                    }
-                    break;
-                default:
-                    break;
-            }
-
-
-            if(g_nv_GPU){
-               strncat(CompilerOptions, " -D NVPU ", sizeof(CompilerOptions));
-            }
-
-#ifdef OCL_DBG
-            if(g_dbg_flag){
-                strncat(CompilerOptions, " -D DEBUG_MODE ", sizeof(CompilerOptions));
-                printf("CompilerOptions: %s\n", CompilerOptions);
-            }
-#endif
-
-            err = clBuildProgram(g_program, 1, &devices[dev_num], CompilerOptions, NULL, NULL);
+            err = clBuildProgram(ctx->program, 1, &devices[dev_num], CompilerOptions, NULL, NULL);
             if (err != CL_SUCCESS){
                 printf("ERROR[%d]: Failed to build program...\n", err);
-                BuildFailLog(g_program, devices[dev_num]);
-                Cleanup_OpenCL();
+                BuildFailLog(ctx->program, devices[dev_num]);
+                Cleanup_OpenCL(ctx);
                 free(sources);
                 return -1;
             }
 
-        //洢õkernelļ
-        char **binaries = (char **)malloc( sizeof(char *) * 1 ); //ֻһ豸
-        size_t *binarySizes = (size_t*)malloc( sizeof(size_t) * 1 );
-
-        err = clGetProgramInfo(g_program,
-            CL_PROGRAM_BINARY_SIZES,
-            sizeof(size_t) * 1,
-            binarySizes, NULL);
-
-        if (CL_SUCCESS != err){
-            printf("WARNING[%d]: Failed to get program bin size ...(%s)\n",
-                   err, getclErrString(err));
-        }
-        else{
-            binaries[0] = (char *)malloc( sizeof(unsigned char) * binarySizes[0]);
-            err = clGetProgramInfo(g_program,
-                CL_PROGRAM_BINARIES,
-                sizeof(char *) * 1,
-                binaries,
-                NULL);
-
-            if (CL_SUCCESS != err){
-                printf("WARNING[%d]: Failed to get program binaray ...(%s)\n",
-                       err, getclErrString(err));
-            }
-            else{
-                //kernelFile.writeBinaryToFile(binfilename, binaries[0], binarySizes[0]);
-            }
+        if(binfilename[0]){
+            SaveProgramBinary(ctx, binfilename);
         }
     }
 
 
-    g_birthday_kernel = clCreateKernel(g_program, "birthdayPhase1", NULL);
-    if (g_birthday_kernel == (cl_kernel)0)
+    ctx->birthday_kernel = clCreateKernel(ctx->program, "birthdayPhase1", NULL);
+    if (ctx->birthday_kernel == (cl_kernel)0)
     {
         printf("ERROR: Failed to create kernel momentum ...\n");
-        Cleanup_OpenCL();
+        Cleanup_OpenCL(ctx);
         free(sources);
         return -1;
     }
 
-    g_match_kernel = clCreateKernel(g_program, "birthdayPhase2", NULL);
-    if (g_match_kernel == (cl_kernel)0)
+    ctx->match_kernel = clCreateKernel(ctx->program, "birthdayVerify", NULL);
+    if (ctx->match_kernel == (cl_kernel)0)
     {
         printf("ERROR: Failed to create kernel match...\n");
-        Cleanup_OpenCL();
+        Cleanup_OpenCL(ctx);
         free(sources);
         return -1;
     }
 
+    if(ctx->gpu_mode == MODE_BITMAP){
+        for(int i = 0; i < BK_NUM; i++){
+            ctx->bitmap_kernels[i] = clCreateKernel(ctx->program, bitmap_kernel_name(ctx, i), &err);
+            if (ctx->bitmap_kernels[i] == (cl_kernel)0)
+            {
+                printf("ERROR[%d]: Failed to create kernel %s ...(%s)\n",
+                       err, bitmap_kernel_name(ctx, i), getclErrString(err));
+                Cleanup_OpenCL(ctx);
+                free(sources);
+                return -1;
+            }
+        }
+    }
+
     free(sources);
 
     return 0; // success...
@@ -711,186 +1190,205 @@ const char* getclErrString(cl_int errcode)
     }
 }
 
-bool ExecuteReadyKernel(unsigned int map_size)
+//event slot for the next profiled command of the turn, NULL when off
+static cl_event *TurnProfEvent(MinerContext *ctx, gpu_turn_set *set, int stage)
 {
-    cl_int err = CL_SUCCESS;
-    cl_uint4 pattern;
-    memset(&pattern, 0, sizeof(cl_uint4));
-
-    QueryPerformanceCounter(&g_PerformanceCountNDRangeStart);
+    if(!ctx->turn_prof || set->prof_num >= TURN_PROF_EVENTS){
+        return NULL;
+    }
+    set->prof[set->prof_num] = NULL;
+    set->prof_stage[set->prof_num] = stage;
+    return &set->prof[set->prof_num++];
+}
 
-    if(g_dbg_flag){
-        puts("\nCall cl 1.2 clEnqueueFillBuffer ready arg 1 ...\n");
+static void TurnProfRelease(MinerContext *ctx, gpu_turn_set *set)
+{
+    for(cl_uint i = 0; i < set->prof_num; i++){
+        if(set->prof[i]){
+            clReleaseEvent(set->prof[i]);
+        }
     }
+    set->prof_num = 0;
+}
 
-    err = clEnqueueFillBuffer(g_cmd_queue, g_inputBuffer, &pattern, sizeof(cl_uint4), 0,
-                        map_size, 0, NULL, NULL);
-    if (err != CL_SUCCESS) {
-        printf("ERROR[%d]: Failed to fill input buffer ready data size %d MBytes. (%s) \n",
-               err, map_size>>20, getclErrString(err));
-        return false;
+static int cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+//read the timestamps of a finished turn, `done` counts as the read stage
+static void TurnProfReport(MinerContext *ctx, gpu_turn_set *set)
+{
+    static const cl_profiling_info names[4] = {
+        CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+    };
+    cl_ulong exec[TS_NUM] = { 0 };
+    cl_ulong driver = 0, queue_wait = 0;
+
+    for(cl_uint i = 0; i <= set->prof_num; i++){
+        cl_event ev = i < set->prof_num ? set->prof[i] : set->done;
+        int stage = i < set->prof_num ? set->prof_stage[i] : TS_READ;
+        cl_ulong t[4];
+
+        for(int k = 0; k < 4; k++){
+            cl_int err = clGetEventProfilingInfo(ev, names[k], sizeof(cl_ulong), &t[k], NULL);
+            if (CL_SUCCESS != err){
+                printf("WARNING[%d]: No profiling data from the device, stage timing disabled. (%s)\n",
+                       err, getclErrString(err));
+                ctx->turn_prof = false;
+                TurnProfRelease(ctx, set);
+                return;
+            }
+        }
+        driver += t[1] - t[0];
+        queue_wait += t[2] - t[1];
+        exec[stage] += t[3] - t[2];
     }
+    TurnProfRelease(ctx, set);
 
-    if(g_dbg_flag){
-        puts("\nCall cl 1.2 clEnqueueFillBuffer redy arg 2 ...\n");
+    for(int s = 0; s < TS_NUM; s++){
+        turn_stage_prof *p = &ctx->stage_prof[s];
+        p->exec[p->count++ % TURN_PROF_WINDOW] = exec[s] / 1e6f;
     }
-    err = clEnqueueFillBuffer(g_cmd_queue, g_matchBuffer, &pattern, sizeof(cl_uint4), 0,
-                        MATCH_ARRAY_SIZE*sizeof(cl_uint), 0, NULL, NULL);
 
-    if (err != CL_SUCCESS) {
-        printf("ERROR[%d]: Failed to fill match buffer ready data size %d MBytes. (%s) \n",
-               err, MATCH_ARRAY_SIZE*sizeof(cl_uint) >> 20, getclErrString(err));
-        return false;
+    if(set->work_num%g_stat_every_turns!=0){
+        return;
     }
 
-    if(g_dbg_flag){
-        puts("\nCall cl 1.2 clEnqueueFillBuffer redy arg 3 ...\n");
+    printf("[P Stat] dev %u turn %u device: upload %.3f ms, fill %.3f ms, phase1 %.3f ms, phase2 %.3f ms,"
+           " read %.3f ms, driver %.3f ms, queue wait %.3f ms\n", ctx->dev_num, set->work_num,
+           exec[TS_UPLOAD]/1e6f, exec[TS_FILL]/1e6f, exec[TS_PHASE1]/1e6f, exec[TS_PHASE2]/1e6f,
+           exec[TS_READ]/1e6f,
+           driver/1e6f, queue_wait/1e6f);
+
+    for(int s = 0; s < TS_NUM; s++){
+        turn_stage_prof *p = &ctx->stage_prof[s];
+        unsigned int n = p->count < TURN_PROF_WINDOW ? p->count : TURN_PROF_WINDOW;
+        float sorted[TURN_PROF_WINDOW];
+        float sum = 0;
+
+        memcpy(sorted, p->exec, n * sizeof(float));
+        qsort(sorted, n, sizeof(float), cmp_float);
+        for(unsigned int i = 0; i < n; i++){
+            sum += sorted[i];
+        }
+        printf("[P Stat] dev %u %-6s min %.3f ms, avg %.3f ms, p99 %.3f ms over %u turns\n",
+               ctx->dev_num, turn_stage_names[s], sorted[0], sum / n, sorted[(n * 99) / 100], n);
     }
+}
 
-    err = clEnqueueFillBuffer(g_cmd_queue, g_result, &pattern, sizeof(cl_uint4), 0,
-                        RESULT_ARRAY_SIZE*sizeof(cl_uint), 0, NULL, NULL);
+//a new slot generation per turn and per pass, the table is empty again
+bool AdvanceTableGen(MinerContext *ctx, unsigned int map_size, gpu_turn_set *set)
+{
+    cl_int err = CL_SUCCESS;
+    cl_uint4 pattern;
+    memset(&pattern, 0, sizeof(cl_uint4));
 
-    if (err != CL_SUCCESS) {
-        printf("ERROR[%d]: Failed to fill result buffer ready data. (%s) \n",
-               err, getclErrString(err));
-        return false;
+    //the full clear is only needed when the slot generation wraps
+    if(++ctx->table_gen > ctx->table_gen_max){
+        ctx->table_gen = 1;
     }
 
-    QueryPerformanceCounter(&g_PerformanceCountNDRangeStop);
+    if(ctx->table_gen == 1){
+        if(g_dbg_flag){
+            puts("\nCall cl 1.2 clEnqueueFillBuffer ready arg 1 ...\n");
+        }
+
+        err = clEnqueueFillBuffer(ctx->cmd_queue, ctx->inputBuffer, &pattern, sizeof(cl_uint4), 0,
+                            map_size, 0, NULL, TurnProfEvent(ctx, set, TS_FILL));
+        if (err != CL_SUCCESS) {
+            printf("ERROR[%d]: Failed to fill input buffer ready data size %d MBytes. (%s) \n",
+                   err, map_size>>20, getclErrString(err));
+            return false;
+        }
+    }
     return true;
 }
 
+bool ExecuteReadyKernel(MinerContext *ctx, unsigned int map_size, gpu_turn_set *set)
+{
+    cl_int err = CL_SUCCESS;
+    cl_uint4 pattern;
+    memset(&pattern, 0, sizeof(cl_uint4));
 
-static uint64 sha512_h0[8] =
-            {0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
-             0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
-             0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
-             0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL};
+    if(!AdvanceTableGen(ctx, map_size, set)){
+        return false;
+    }
 
-#define UNPACK32(x, str)                      \
-{                                             \
-    *((str) + 3) = (uint8) ((x)      );       \
-    *((str) + 2) = (uint8) ((x) >>  8);       \
-    *((str) + 1) = (uint8) ((x) >> 16);       \
-    *((str) + 0) = (uint8) ((x) >> 24);       \
-}
-
-#define PACK32(str, x)                        \
-{                                             \
-    *(x) =   ((uint32) *((str) + 3)      )    \
-           | ((uint32) *((str) + 2) <<  8)    \
-           | ((uint32) *((str) + 1) << 16)    \
-           | ((uint32) *((str) + 0) << 24);   \
-}
-
-#define UNPACK64(x, str)                      \
-{                                             \
-    *((str) + 7) = (uint8) ((x)      );       \
-    *((str) + 6) = (uint8) ((x) >>  8);       \
-    *((str) + 5) = (uint8) ((x) >> 16);       \
-    *((str) + 4) = (uint8) ((x) >> 24);       \
-    *((str) + 3) = (uint8) ((x) >> 32);       \
-    *((str) + 2) = (uint8) ((x) >> 40);       \
-    *((str) + 1) = (uint8) ((x) >> 48);       \
-    *((str) + 0) = (uint8) ((x) >> 56);       \
-}
-
-#define PACK64(str, x)                        \
-{                                             \
-    *(x) =   ((uint64) *((str) + 7)      )    \
-           | ((uint64) *((str) + 6) <<  8)    \
-           | ((uint64) *((str) + 5) << 16)    \
-           | ((uint64) *((str) + 4) << 24)    \
-           | ((uint64) *((str) + 3) << 32)    \
-           | ((uint64) *((str) + 2) << 40)    \
-           | ((uint64) *((str) + 1) << 48)    \
-           | ((uint64) *((str) + 0) << 56);   \
-}
-
-
-void sha512_midhash(uint64 *w, const unsigned char *message)
-{
-    //uint64 w[16];
-    unsigned int block_nb;
-    //unsigned int new_len, rem_len, tmp_len;
-    //const unsigned char *shifted_message;
-
-    sha512_ctx _ctx;
-    sha512_ctx * ctx = &_ctx;
-
-    int i;
-    for (i = 0; i < 8; i++) {
-        ctx->h[i] = sha512_h0[i];
-    }
-
-    ctx->len = 4;
-    ctx->tot_len = 0;
+    if(g_dbg_flag){
+        puts("\nCall cl 1.2 clEnqueueFillBuffer redy arg 2 ...\n");
+    }
+    //only the counter, entries past it are never read
+    err = clEnqueueFillBuffer(ctx->cmd_queue, set->match, &pattern, sizeof(cl_uint4), 0,
+                        sizeof(cl_uint4), 0, NULL, TurnProfEvent(ctx, set, TS_FILL));
 
-    memset(&ctx->block[0], 0, 4); // fill 0 as birthday nonce
-    memcpy(&ctx->block[ctx->len], message, 32);
-
-    ctx->len += 32;
+    if (err != CL_SUCCESS) {
+        printf("ERROR[%d]: Failed to fill match buffer counter. (%s) \n",
+               err, getclErrString(err));
+        return false;
+    }
 
-    block_nb = 1 + ((SHA512_BLOCK_SIZE - 17)
-		< (ctx->len % SHA512_BLOCK_SIZE));
-
-	unsigned int len_b = (ctx->tot_len + ctx->len) << 3;
-	unsigned int pm_len = block_nb << 7;
-
-	memset(ctx->block + ctx->len, 0, pm_len - ctx->len);
-	memcpy((unsigned char*)w, ctx->block, 16*8);
-
-	ctx->block[ctx->len] = 0x80;
-
-	UNPACK32(len_b, ctx->block + pm_len - 4);
+    if(g_dbg_flag){
+        puts("\nCall cl 1.2 clEnqueueFillBuffer redy arg 3 ...\n");
+    }
 
-	for (int j = 0; j < 16; j++) {
-        PACK64(&ctx->block[j << 3], &w[j]);
-    }
-}
+    //the counters too, birthdayVerify writes every pair it counts
+    err = clEnqueueFillBuffer(ctx->cmd_queue, set->result, &pattern, sizeof(cl_uint4), 0,
+                        sizeof(cl_uint4), 0, NULL, TurnProfEvent(ctx, set, TS_FILL));
+
+    if (err != CL_SUCCESS) {
+        printf("ERROR[%d]: Failed to fill result buffer ready data. (%s) \n",
+               err, getclErrString(err));
+        return false;
+    }
+
+    return true;
+}
 
 
 extern "C" void  dumpBirthDayHash(const uint8* midHash, uint32 indexA);
 
-bool ExecuteBirthdayKernel(cl_long** inputArray, /*cl_int arraySize,*/ const unsigned char * midhash,
-                           const int nonce_offset)
+//bitmap mode, the turn blocks on its results before midhash_host is reused
+bool WriteMidhashBuffer(MinerContext *ctx, const unsigned char *midhash)
 {
-    cl_int err = CL_SUCCESS;
-    uint64_t inp[16];
-
-    sha512_midhash(inp, midhash);
-
-    //create OpenCL buffer using input array memory
-    if(g_midhash==NULL){
-        g_midhash = clCreateBuffer(g_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                   MID_HASH_BUF_SIZE, (void*)inp, &err);
+    sha512_birthday_init(ctx->midhash_host, midhash);
 
-        if (CL_SUCCESS != err){
-            printf("ERROR[%d]: Failed to create input mid hash buffer size(0x%x)Bytes, (%s)\n",
-                   err, MID_HASH_BUF_SIZE, getclErrString(err));
-            return false;
-        }
+    cl_int err = clEnqueueWriteBuffer(ctx->cmd_queue, ctx->midhash, CL_FALSE, 0,
+                                      MID_HASH_BUF_SIZE, ctx->midhash_host, 0, NULL, NULL);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to write midhash buffer. (%s)\n",
+               err, getclErrString(err));
+        return false;
     }
+    return true;
+}
 
+bool ExecuteBirthdayKernel(MinerContext *ctx, gpu_turn_set *set, const cl_uint table_gen,
+                           const cl_uint pass)
+{
+    cl_int err = CL_SUCCESS;
 
-    if(g_offset==NULL){
-        g_offset = clCreateBuffer(g_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(uint32),
-                              (void*)&nonce_offset, &err);
+    //set->host is not touched again until the turn's result event completes
+    if(pass == 0){
+        err = clEnqueueWriteBuffer(ctx->cmd_queue, set->midhash, CL_FALSE, 0,
+                                   MID_HASH_BUF_SIZE, &set->host->ctx, 0, NULL, TurnProfEvent(ctx, set, TS_UPLOAD));
     }
-    if (CL_SUCCESS != err){
-        printf("ERROR[%d]: Failed to create input nonce offset buffer size(0x%x)Bytes, (%s)\n",
-               err, sizeof(uint32), getclErrString(err));
+    if (err != CL_SUCCESS){
+        printf("ERROR[%d]: Failed to write midhash buffer. (%s)\n",
+                err, getclErrString(err));
         return false;
     }
 
-    err = clSetKernelArg(g_birthday_kernel, 0, sizeof(cl_mem), (void *) &g_midhash);
+    err = clSetKernelArg(ctx->birthday_kernel, 0, sizeof(cl_mem), (void *) &set->midhash);
     if (err != CL_SUCCESS){
         printf("ERROR[%d]: Failed to set midhash kernel arguments. (%s)\n",
                 err, getclErrString(err));
         return false;
     }
 
-    err = clSetKernelArg(g_birthday_kernel, 1, sizeof(cl_mem), (void *) &g_inputBuffer);
+    err = clSetKernelArg(ctx->birthday_kernel, 1, sizeof(cl_mem), (void *) &ctx->inputBuffer);
     if (err != CL_SUCCESS)
     {
         printf("ERROR[%d]: Failed to set input buffer 1 kernel arguments. (%s) \n",
@@ -899,7 +1397,7 @@ bool ExecuteBirthdayKernel(cl_long** inputArray, /*cl_int arraySize,*/ const uns
     }
 
 
-    err = clSetKernelArg(g_birthday_kernel, 2, sizeof(cl_mem), (void *) &g_matchBuffer);
+    err = clSetKernelArg(ctx->birthday_kernel, 2, sizeof(cl_mem), (void *) &set->match);
 
     if (err != CL_SUCCESS)
     {
@@ -908,19 +1406,25 @@ bool ExecuteBirthdayKernel(cl_long** inputArray, /*cl_int arraySize,*/ const uns
         return false;
     }
 
-    err = clSetKernelArg(g_birthday_kernel, 3, sizeof(cl_mem), (void *) &g_offset);
+    err = clSetKernelArg(ctx->birthday_kernel, 3, sizeof(cl_uint), (void *) &table_gen);
+    if (err != CL_SUCCESS){
+        printf("ERROR[%d]: Failed to set table generation kernel argument. (%s)\n",
+                err, getclErrString(err));
+        return false;
+    }
+
+    err = clSetKernelArg(ctx->birthday_kernel, 4, sizeof(cl_uint), (void *) &pass);
     if (err != CL_SUCCESS){
-        printf("ERROR: Failed to create kernel momentum. \n"
-                /*err, getclErrString(err)*/);
+        printf("ERROR[%d]: Failed to set table pass kernel argument. (%s)\n",
+                err, getclErrString(err));
         return false;
     }
 
 
-    QueryPerformanceCounter(&g_PerformanceCountNDRangeStart);
     // set work-item dimensions
-    size_t gsz = 1 <<24;
+    size_t gsz = TABLE_HASHES_PER_TURN / ctx->vector_width; //one hash per vector lane
     size_t global_work_size[1] = {gsz};	//number of quad items in input array
-    size_t ws = g_work_size;/*g_work_size*/
+    size_t ws = ctx->work_size;
     size_t local_work_size[1]= {ws};					//valid WG sizes are 1:1024
 
 
@@ -929,35 +1433,23 @@ bool ExecuteBirthdayKernel(cl_long** inputArray, /*cl_int arraySize,*/ const uns
     }
 
     // execute kernel
-    err = clEnqueueNDRangeKernel(g_cmd_queue, g_birthday_kernel, 1,
+    err = clEnqueueNDRangeKernel(ctx->cmd_queue, ctx->birthday_kernel, 1,
                                              NULL, global_work_size,
-                                             local_work_size, 0, NULL, NULL);
+                                             local_work_size, 0, NULL, TurnProfEvent(ctx, set, TS_PHASE1));
     if (CL_SUCCESS != err){
         printf("ERROR[%d]: Failed to execute birthday kernel (%s).\n", err, getclErrString(err));
         return false;
     }
-    err = clFinish(g_cmd_queue);
-
-    if (CL_SUCCESS != err){
-        printf("ERROR[%d]: Failed to finish cmd queue (%s).\n", err, getclErrString(err));
-        return false;
-    }
-
-    QueryPerformanceCounter(&g_PerformanceCountNDRangeStop);
-
-
-    clEnqueueUnmapMemObject(g_cmd_queue, g_inputBuffer, *inputArray, 0, NULL, NULL);
-    clReleaseMemObject(g_offset); g_offset = NULL;
     return true;
 }
 
 
-bool InitBirthdayBuffer(const unsigned int arraySize)
+bool InitBirthdayBuffer(MinerContext *ctx, const unsigned int arraySize)
 {
    //create OpenCL buffer
     cl_int err = CL_SUCCESS;
-    if(g_inputBuffer == NULL){
-        g_inputBuffer = clCreateBuffer(g_context,
+    if(ctx->inputBuffer == NULL){
+        ctx->inputBuffer = clCreateBuffer(ctx->context,
                         CL_MEM_WRITE_ONLY, arraySize, NULL,&err);
 
         if (CL_SUCCESS != err){
@@ -974,14 +1466,11 @@ bool InitBirthdayBuffer(const unsigned int arraySize)
     return true;
 }
 
-bool ExecuteMatchKernel(cl_uint** resultArray, const cl_uint pairs_found,
-                        const unsigned int array_size)
+bool ExecuteMatchKernel(MinerContext *ctx, gpu_turn_set *set, const unsigned int array_size)
 {
     cl_int err = CL_SUCCESS;
-    //cl_uint matchSize = pairs_found * 2 * sizeof(cl_uint);
-    //create OpenCL buffer using input array memory
 
-    err = clSetKernelArg(g_match_kernel, 0, sizeof(cl_mem), (void *) &g_midhash);
+    err = clSetKernelArg(ctx->match_kernel, 0, sizeof(cl_mem), (void *) &set->midhash);
     if (err != CL_SUCCESS)
     {
         printf("ERROR[%d]: Failed to set midhash kernel arguments.(%s)\n",
@@ -989,9 +1478,9 @@ bool ExecuteMatchKernel(cl_uint** resultArray, const cl_uint pairs_found,
         return false;
     }
 
-    err = clSetKernelArg(g_match_kernel, 1, sizeof(cl_mem), (void *) &g_matchBuffer);
-    //err |= clSetKernelArg(g_birthday_kernel, 1, sizeof(cl_uint4), (void *) &midstate0);
-    //err |= clSetKernelArg(g_birthday_kernel, 2, sizeof(cl_mem), (void *) &g_offset);
+    err = clSetKernelArg(ctx->match_kernel, 1, sizeof(cl_mem), (void *) &set->match);
+    //err |= clSetKernelArg(ctx->birthday_kernel, 1, sizeof(cl_uint4), (void *) &midstate0);
+    //err |= clSetKernelArg(ctx->birthday_kernel, 2, sizeof(cl_mem), (void *) &g_offset);
 
     if (err != CL_SUCCESS){
         printf("ERROR[%d]: Failed to set input buffer kernel arguments.(%s)\n",
@@ -999,7 +1488,8 @@ bool ExecuteMatchKernel(cl_uint** resultArray, const cl_uint pairs_found,
         return false;
     }
 
-    err = clSetKernelArg(g_match_kernel, 2, sizeof(cl_mem), (void *) &g_result);
+    err = clSetKernelArg(ctx->match_kernel, 2, sizeof(cl_mem), (void *) &set->result);
+    err |= clSetKernelArg(ctx->match_kernel, 3, sizeof(cl_uint), (void *) &set->result_pairs);
     if (err != CL_SUCCESS)
     {
         printf("ERROR[%d]: Failed to set result kernel arguments.(%s)\n",
@@ -1007,7 +1497,6 @@ bool ExecuteMatchKernel(cl_uint** resultArray, const cl_uint pairs_found,
         return false;
     }
 
-    QueryPerformanceCounter(&g_PerformanceCountNDRangeStart);
     // set work-item dimensions
     size_t gsz =  array_size >> 1;//(g_vector_width/2);// >> 3;// << 10;
     size_t global_work_size[1] = {gsz};	//number of quad items in input array
@@ -1015,34 +1504,22 @@ bool ExecuteMatchKernel(cl_uint** resultArray, const cl_uint pairs_found,
     size_t local_work_size[1]= { 64 };					//valid WG sizes are 1:1024
 
     // execute kernel
-    err = clEnqueueNDRangeKernel(g_cmd_queue, g_match_kernel, 1,
+    err = clEnqueueNDRangeKernel(ctx->cmd_queue, ctx->match_kernel, 1,
                                              NULL, global_work_size,
-                                             local_work_size, 0, NULL, NULL);
+                                             local_work_size, 0, NULL, TurnProfEvent(ctx, set, TS_PHASE2));
     if (CL_SUCCESS != err){
         printf("ERROR[%d]: Failed to execute match kernel (%s).\n", err, getclErrString(err));
         return false;
     }
 
-    err = clFinish(g_cmd_queue);
-    if (CL_SUCCESS != err){
-        printf("ERROR[%d]: Failed to finish match cmd queue (%s).\n", err, getclErrString(err));
-        return false;
-    }
-
-    QueryPerformanceCounter(&g_PerformanceCountNDRangeStop);
-
-    *resultArray = (cl_uint *)clEnqueueMapBuffer(g_cmd_queue, g_result, true,
-                                 CL_MAP_READ, 0, sizeof(cl_uint) * RESULT_ARRAY_SIZE,
-                                 0, NULL, NULL, &err);
-
-    if (CL_SUCCESS != err){
-        printf("ERROR[%d]: Failed to map result buffer (%s).\n", err, getclErrString(err));
-        return false;
-    }
-
-    err = clFinish(g_cmd_queue);
+    //the only host sync point of the turn, waited on by gpu_turn_collect().
+    //The first pairs come along so a normal turn needs no second read,
+    //which would have to wait for the turn queued behind this one
+    err = clEnqueueReadBuffer(ctx->cmd_queue, set->result, CL_FALSE, 0,
+                              sizeof(set->host->header), set->host->header,
+                              0, NULL, &set->done);
     if (CL_SUCCESS != err){
-        printf("ERROR[%d]: Failed to finish cmd queue (%s).\n", err, getclErrString(err));
+        printf("ERROR[%d]: Failed to read result buffer (%s).\n", err, getclErrString(err));
         return false;
     }
 
@@ -1052,26 +1529,49 @@ bool ExecuteMatchKernel(cl_uint** resultArray, const cl_uint pairs_found,
 
 void Usage()
 {
-    printf("Usage: ominer_kernel.exe [--help] -d device_enum [-s <VRam Size in MB>] [ -D ] [ -a (geekj|alpha|gen)] [-p platform]\n");
-    printf("    -d GPU device enumration base 0 \n");
+    printf("Usage: ominer_kernel.exe [--help] -d device_enum [-s <VRam Size in MB>] [ -D ] [ -a (geekj|alpha|gen)] [-p platform] [-c threads] [-m (table|bitmap)] [--autotune]\n"
+           "                         [--device-type (gpu|cpu|accelerator|all)] [--device-name name] [--list-devices] [--cpu-batch depth]\n"
+           "                         [--cpu-engine (table|partition|sort)] [--mem-budget MB] [--sub-devices n]\n");
+    printf("    -d Device enumration base 0 within --device-type, a list like 0,1,3 or all to mine on several\n");
+    printf("    -p Platform enumration base 0, or a part of its name\n");
+    printf("    -m GPU search mode: table (default) or bitmap, 1 bit per birthday for small VRam\n");
+    printf("    -c Search on CPU with threads, 0 for all cores (no GPU needed)\n");
+    printf("    --cpu-batch Birthdays whose table lines -c prefetches before probing, 1 to %u (default %u)\n",
+           CPU_BATCH_MAX, CPU_BATCH_DEFAULT);
+    printf("    --cpu-engine -c search: table (default), partition, radix partitions matched in cache,\n"
+           "                 or sort, an exact radix sort of every birthday\n");
+    printf("    --mem-budget MB the -s table may use, a larger one is searched in several passes\n");
+    printf("    --autotune Benchmark -a, -s and -W on the device and save the best to ominer_tune.txt\n");
+    printf("    --device-type OpenCL device type to mine on, gpu (default), cpu, accelerator or all\n");
+    printf("    --device-name Only mine on the -d devices whose name contains this\n");
+    printf("    --list-devices Print every platform's devices and their capabilities, then exit\n");
+    printf("    --sub-devices Split every device into n sub-devices that count as devices, 2 to %u,\n"
+           "                  e.g. to run several device workers on a CPU OpenCL runtime\n", SUB_DEVICES_MAX);
     exit(-1);
 }
 
 
-static unsigned int  totalCollisionCount = 0;
+
+//digest of the hash holding nonce, words laid out as sha512() writes them
+static void birthday_digest(const sha512_birthday_ctx *ctx, uint32 nonce, uint64 *digest)
+{
+	uint32 base = nonce & ~(BIRTHDAYS_PER_HASH - 1);
+	sha512_birthday(ctx, &base, digest);
+}
+
+static uint64 birthday_of(const sha512_birthday_ctx *ctx, uint32 nonce)
+{
+	uint64 digest[8];
+	birthday_digest(ctx, nonce, digest);
+	return digest[nonce % BIRTHDAYS_PER_HASH] >> (64ULL-SEARCH_SPACE_BITS);
+}
 
 extern "C" void  dumpBirthDayHash(const uint8* midHash, uint32 indexA)
 {
-    uint32 hashData[9];
-	uint8 *tempHash = (uint8 *)hashData;
-	uint64 resultHash[8];
-	memcpy(tempHash+4, midHash, 32);
-	// get birthday A
-	hashData[0] = indexA&~7;
-	sha512_ctx c512;
-	sha512_init(&c512);
-	sha512_update(&c512, tempHash, 32+4);
-	sha512_final(&c512, (unsigned char*)resultHash);
+	uint64 resultHash[8];
+	sha512_birthday_ctx c512;
+	sha512_birthday_init(&c512, midHash);
+	birthday_digest(&c512, indexA, resultHash);
 	printf("BirHash of 0x%08x:", indexA);
 	for(unsigned int i =0 ; i< 8; i++){
             if ( (indexA&7) == i) putchar('['); else putchar(' ');
@@ -1097,27 +1597,10 @@ extern "C" bool submit_validate(const unsigned char * block, bool verbose)
 	unsigned int indexA = *(unsigned int*)(block + 80);
 	unsigned int indexB = *(unsigned int*)(block + 84);
 
-    uint32 hashData[9];
-	uint8 * tempHash = (uint8 *)hashData;
-	uint64 resultHash[8];
-	memcpy(tempHash+4, midHash, 32);
-
-	// get birthday A
-	hashData[0] = indexA&~7;
-	sha512_ctx c512;
-	sha512_init(&c512);
-	sha512_update(&c512, tempHash, 32+4);
-	sha512_final(&c512, (unsigned char*)resultHash);
-	uint64 birthdayA = resultHash[indexA&7] >> (64ULL-SEARCH_SPACE_BITS);
-	//dump_hashes32((uint32*)resultHash, 16);
-
-	// get birthday B
-	hashData[0] = indexB&~7;
-	sha512_init(&c512);
-	sha512_update(&c512, tempHash, 32+4);
-	sha512_final(&c512, (unsigned char*)resultHash);
-	uint64 birthdayB = resultHash[indexB&7] >> (64ULL-SEARCH_SPACE_BITS);
-    //dump_hashes32((uint32*)resultHash, 16);
+	sha512_birthday_ctx c512;
+	sha512_birthday_init(&c512, midHash);
+	uint64 birthdayA = birthday_of(&c512, indexA);
+	uint64 birthdayB = birthday_of(&c512, indexB);
 
 	if( verbose ){
             printf("[Info]Validated  block:");
@@ -1174,26 +1657,10 @@ static bool conflict_validate(const char * block, const uint8* midHash,
 #ifdef TEST_NO_VAL
     return false;
 #endif
-    uint32 hashData[9];
-	uint8 * tempHash = (uint8 *)hashData;
-	uint64 resultHash[8];
-	memcpy(tempHash+4, midHash, 32);
-	// get birthday A
-	hashData[0] = indexA&~7;
-	sha512_ctx c512;
-	sha512_init(&c512);
-	sha512_update(&c512, tempHash, 32+4);
-	sha512_final(&c512, (unsigned char*)resultHash);
-	uint64 birthdayA = resultHash[indexA&7] >> (64ULL-SEARCH_SPACE_BITS);
-	//dump_hashes32((uint32*)resultHash, 16);
-
-	// get birthday B
-	hashData[0] = indexB&~7;
-	sha512_init(&c512);
-	sha512_update(&c512, tempHash, 32+4);
-	sha512_final(&c512, (unsigned char*)resultHash);
-	uint64 birthdayB = resultHash[indexB&7] >> (64ULL-SEARCH_SPACE_BITS);
-    //dump_hashes32((uint32*)resultHash, 16);
+	sha512_birthday_ctx c512;
+	sha512_birthday_init(&c512, midHash);
+	uint64 birthdayA = birthday_of(&c512, indexA);
+	uint64 birthdayB = birthday_of(&c512, indexB);
 
 	if( birthdayA != birthdayB )
 	{
@@ -1216,22 +1683,92 @@ static bool conflict_validate(const char * block, const uint8* midHash,
 		return false; // invalid collision
 	}
 	// birthday collision found
-	*matchBirthDay = birthdayA;
-	totalCollisionCount += 2;
+	*matchBirthDay = birthdayA;
 	return true;
-
+
+}
+
+/*
+Staging buffer the driver may back with page-locked memory. It is mapped
+once and stays mapped until Cleanup_OpenCL(), so per-turn transfers from
+and to it need no allocation, pinning or map calls.
+*/
+static void *CreatePinnedBuffer(MinerContext *ctx, cl_mem *pinned, size_t size)
+{
+    cl_int err = CL_SUCCESS;
+    *pinned = clCreateBuffer(ctx->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                             size, NULL, &err);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to create pinned staging buffer, size: %u Bytes, (%s)\n",
+               err, (unsigned int)size, getclErrString(err));
+        *pinned = NULL;
+        return NULL;
+    }
+
+    void *host = clEnqueueMapBuffer(ctx->cmd_queue, *pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                    0, size, 0, NULL, NULL, &err);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to map pinned staging buffer. (%s)\n",
+               err, getclErrString(err));
+        clReleaseMemObject(*pinned);
+        *pinned = NULL;
+        return NULL;
+    }
+    return host;
+}
+
+//header plus ctx->result_pairs collisions
+static bool CreateResultBuffer(MinerContext *ctx, gpu_turn_set *set)
+{
+    cl_int err = CL_SUCCESS;
+    if(ctx->result_pairs == 0){
+        ctx->result_pairs = (RESULT_ARRAY_SIZE - 2) / 2;    //never below RESULT_PREFIX_PAIRS
+    }
+    size_t bufSize = (2 + 2 * (size_t)ctx->result_pairs) * sizeof(cl_uint);
+
+    set->result = clCreateBuffer(ctx->context, CL_MEM_READ_WRITE, bufSize, NULL, &err);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to create data Buffer, size: %u(0x%x) Bytes, (%s)\n",
+               err, (unsigned int)bufSize, (unsigned int)bufSize,
+               getclErrString(err));
+        set->result = NULL;
+        return false;
+    }
+    set->result_pairs = ctx->result_pairs;
+    return true;
 }
 
+//room for pairs nonce pairs in ctx->found, kept across turns
+static bool ReserveFound(MinerContext *ctx, unsigned int pairs)
+{
+    if(2 * pairs <= ctx->found_size){
+        return true;
+    }
+    unsigned int size = ctx->found_size ? ctx->found_size : 2 * MAX_FOUND_IN_TURN;
+    while(size < 2 * pairs){
+        size *= 2;
+    }
+    cl_uint *found = (cl_uint *)realloc(ctx->found, size * sizeof(cl_uint));
+    if(found == NULL){
+        printf("ERROR: Failed to grow the found list to %u pairs.\n", pairs);
+        return false;
+    }
+    ctx->found = found;
+    ctx->found_size = size;
+    return true;
+}
 
-extern "C" int initGPUBuffer(cl_uint conflictSize);
+extern "C" int initGPUBuffer(MinerContext *ctx, cl_uint conflictSize);
 
-int initGPUBuffer(cl_uint conflictSize)
+int initGPUBuffer(MinerContext *ctx, cl_uint conflictSize)
 {
     //create OpenCL buffer
     cl_int err = CL_SUCCESS;
-    unsigned int bufSize = conflictSize;
-    if(g_inputBuffer == NULL){
-        g_inputBuffer = clCreateBuffer(g_context,
+    unsigned int bufSize = ctx->bitmap_2buf ? conflictSize/2 : conflictSize;
+    cl_mem *maps[2] = { &ctx->inputBuffer, &ctx->inputBuffer2 };
+    for(int i = 0; i < (ctx->bitmap_2buf ? 2 : 1); i++){
+      if(*maps[i] == NULL){
+        *maps[i] = clCreateBuffer(ctx->context,
                         CL_MEM_WRITE_ONLY, bufSize, NULL,&err);
 
         if (CL_SUCCESS != err){
@@ -1244,157 +1781,1218 @@ int initGPUBuffer(cl_uint conflictSize)
         printf("[Info] Created device data buffer, size: %u(0x%x) MBytes Ok.\n",
                    bufSize>>20, bufSize>>20);
         }
+      }
     }
 
-    bufSize = MATCH_ARRAY_SIZE * sizeof(cl_uint);
-    if(g_matchBuffer == NULL){
-        g_matchBuffer = clCreateBuffer(g_context,
-                        CL_MEM_WRITE_ONLY, bufSize, NULL,&err);
+    if(ctx->gpu_mode != MODE_BITMAP){
+        for(int i = 0; i < GPU_TURN_SETS; i++){
+            gpu_turn_set *set = &ctx->turn_sets[i];
+
+            if(set->midhash == NULL){
+                set->midhash = clCreateBuffer(ctx->context,
+                                CL_MEM_READ_ONLY, MID_HASH_BUF_SIZE, NULL, &err);
+                if (CL_SUCCESS != err){
+                    printf("ERROR[%d]: Failed to create input mid hash buffer size(0x%x)Bytes, (%s)\n",
+                           err, MID_HASH_BUF_SIZE, getclErrString(err));
+                    return 1;
+                }
+            }
+
+            bufSize = MATCH_ARRAY_SIZE * sizeof(cl_uint);
+            if(set->match == NULL){
+                set->match = clCreateBuffer(ctx->context,
+                                CL_MEM_READ_WRITE, bufSize, NULL, &err);
+                if (CL_SUCCESS != err){
+                    printf("ERROR[%d]: Failed to create device data Buffer, size: %u(0x%x) MBytes, (%s)\n",
+                           err, bufSize>>20, bufSize>>20,
+                           getclErrString(err));
+                    return 1;
+                }
+            }
+
+            if(set->result == NULL && !CreateResultBuffer(ctx, set)){
+                return 1;
+            }
 
+            if(set->pinned == NULL){
+                set->host = (gpu_turn_host *)CreatePinnedBuffer(ctx, &set->pinned, sizeof(gpu_turn_host));
+                if(set->host == NULL){
+                    return 1;
+                }
+            }
+        }
+        printf("[Info] Created %d turn buffer sets Ok.\n", GPU_TURN_SETS);
+        return 0;
+    }
+
+    if(ctx->midhash == NULL){
+        ctx->midhash = clCreateBuffer(ctx->context,
+                        CL_MEM_READ_ONLY, MID_HASH_BUF_SIZE, NULL, &err);
         if (CL_SUCCESS != err){
-            printf("ERROR[%d]: Failed to create device data Buffer, size: %u(0x%x) MBytes, (%s)\n",
-                   err, bufSize>>20, bufSize>>20,
-                   getclErrString(err));
+            printf("ERROR[%d]: Failed to create input mid hash buffer size(0x%x)Bytes, (%s)\n",
+                   err, MID_HASH_BUF_SIZE, getclErrString(err));
             return 1;
         }
-        else{
-       /* printf("[Info] Created device data buffer, size: %u(0x%x) MBytes Ok.\n",
-                   bufSize>>20, bufSize>>20);*/
+    }
+    if(ctx->midhash_pinned == NULL){
+        ctx->midhash_host = (sha512_birthday_ctx *)CreatePinnedBuffer(ctx, &ctx->midhash_pinned,
+                                                                      MID_HASH_BUF_SIZE);
+        if(ctx->midhash_host == NULL){
+            return 1;
         }
     }
 
-    bufSize = RESULT_ARRAY_SIZE * sizeof(cl_uint);
-    if(g_result == NULL){
-        g_result = clCreateBuffer(g_context,
-                        CL_MEM_READ_WRITE, bufSize, NULL,&err);
+    bufSize = BITMAP_LIST_SIZE;
+    cl_mem *lists[3] = { &ctx->bitmap_list, &ctx->bitmap_domain[0], &ctx->bitmap_domain[1] };
+    for(int i = 0; i < 3; i++){
+        if(*lists[i] == NULL){
+            *lists[i] = clCreateBuffer(ctx->context,
+                            CL_MEM_READ_WRITE, bufSize, NULL,&err);
 
-        if (CL_SUCCESS != err){
-            printf("ERROR[%d]: Failed to create data Buffer, size: %u(0x%x) Bytes, (%s)\n",
-                   err, bufSize, bufSize,
-                   getclErrString(err));
-            return 1;
-        }
-        else{
-        /*printf("[Info] Created data buffer, size: %u(0x%x) Bytes Ok.\n",
-                   bufSize, bufSize);*/
+            if (CL_SUCCESS != err){
+                printf("ERROR[%d]: Failed to create bitmap list Buffer, size: %u(0x%x) MBytes, (%s)\n",
+                       err, bufSize>>20, bufSize>>20,
+                       getclErrString(err));
+                return 1;
+            }
         }
     }
+    printf("[Info] Created bitmap list buffers, 3 x %u MBytes Ok.\n", bufSize>>20);
     return 0;
 }
 
-extern "C" int match_birthday_gpu_alg(unsigned int work_num,
-                        cl_int map_size, const unsigned char* midhash,
-                        unsigned int *nonce_array, unsigned int *found_num);
-
 
-
-int match_birthday_gpu_alg(unsigned int work_num,
-                        cl_int map_size, const unsigned char* midhash,
-                        unsigned int *nonce_array, unsigned int *found_num)
+/*
+Queue a whole table turn without waiting for it: fills, the two kernels
+and the result read. Turns must be collected in submit order, at most
+GPU_TURN_SETS of them may be outstanding per device.
+*/
+int gpu_turn_submit(MinerContext *ctx, unsigned int work_num,
+                        cl_int map_size, const unsigned char* midhash)
 {
-    if(!ExecuteReadyKernel(map_size)){
+    gpu_turn_set *set = &ctx->turn_sets[ctx->turn_seq % GPU_TURN_SETS];
+
+    if(set->done){
+        printf("ERROR: Turn %u buffers are still in use by turn %u.\n",
+               work_num, set->work_num);
         return 1;
     }
+    ctx->turn_seq++;
 
+    set->work_num = work_num;
+    memcpy(set->midhash_bytes, midhash, 32);
+    sha512_birthday_init(&set->host->ctx, midhash);
+    set->submitted = perf_clock::now();
 
-    QueryPerformanceFrequency(&g_PerfFrequency);
-
-
-    if(work_num%g_stat_every_turns==0){
-        printf("[G Stat] Counter rk time %f ms, ",
-            1000.0f*(float)(g_PerformanceCountNDRangeStop.QuadPart -
-                             g_PerformanceCountNDRangeStart.QuadPart)/(float)g_PerfFrequency.QuadPart);
+    //the match list collects every pass, one phase 2 checks them all
+    if(!ExecuteReadyKernel(ctx, map_size, set)){
+        return 1;
+    }
+    for(cl_uint pass = 0; pass < ctx->table_passes; pass++){
+        if((pass > 0 && !AdvanceTableGen(ctx, map_size, set)) ||
+           !ExecuteBirthdayKernel(ctx, set, ctx->table_gen, pass)){
+            return 1;
+        }
+    }
+    if(!ExecuteMatchKernel(ctx, set, MATCH_ARRAY_SIZE)){
+        return 1;
     }
 
-    cl_uint *result;
-
-    if(!ExecuteBirthdayKernel((cl_long**)&result, midhash, 0)){
+    //start the device now, the host is about to block on the previous turn
+    cl_int err = clFlush(ctx->cmd_queue);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to flush cmd queue (%s).\n", err, getclErrString(err));
         return 1;
     }
+    return 0;
+}
 
-    QueryPerformanceFrequency(&g_PerfFrequency);
+int gpu_turn_collect(MinerContext *ctx, unsigned int work_num,
+                        const unsigned int **nonce_array, unsigned int *found_num)
+{
+    gpu_turn_set *set = NULL;
+    perf_clock::time_point wait_start, wait_stop, validate_stop;
 
-    if(work_num%g_stat_every_turns==0){
-        printf("k1 time %f ms, ",
-            1000.0f*(float)(g_PerformanceCountNDRangeStop.QuadPart -
-                             g_PerformanceCountNDRangeStart.QuadPart)/(float)g_PerfFrequency.QuadPart);
+    for(int i = 0; i < GPU_TURN_SETS; i++){
+        if(ctx->turn_sets[i].done && ctx->turn_sets[i].work_num == work_num){
+            set = &ctx->turn_sets[i];
+        }
+    }
+    if(set == NULL){
+        printf("ERROR: Turn %u was not submitted.\n", work_num);
+        return 1;
     }
 
-    if(!ExecuteMatchKernel(&result, g_total_found, MATCH_ARRAY_SIZE)){
-       return 1;
+    wait_start = perf_clock::now();
+    cl_int err = clWaitForEvents(1, &set->done);
+    wait_stop = perf_clock::now();
+    if (CL_SUCCESS == err && ctx->turn_prof){
+        TurnProfReport(ctx, set);
     }
+    TurnProfRelease(ctx, set);
+    clReleaseEvent(set->done);
+    set->done = NULL;
 
-    if(g_midhash){
-          clReleaseMemObject(g_midhash);
-          g_midhash = NULL;
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to wait for turn %u result (%s).\n",
+               err, work_num, getclErrString(err));
+        return 1;
     }
 
-    QueryPerformanceFrequency(&g_PerfFrequency);
-    if(work_num%g_stat_every_turns==0){
-       printf(" k2 %f ms. ---->\n",
-            1000.0f*(float)(g_PerformanceCountNDRangeStop.QuadPart -
-                             g_PerformanceCountNDRangeStart.QuadPart)/(float)g_PerfFrequency.QuadPart);
+    //birthdayVerify already compared the full birthdays, pairs are exact
+    uint64 tem;
+    const unsigned char *midhash = set->midhash_bytes;
+    unsigned int match_cnt = set->host->header[0];
+    unsigned int found_cnt = set->host->header[1];
+
+    if(match_cnt > MATCH_PAIRS){
+        printf("WARNING: Turn %u dropped %u phase 1 pairs past the match list.\n",
+               work_num, match_cnt - MATCH_PAIRS);
+        ctx->match_overflow += match_cnt - MATCH_PAIRS;
+    }
+    if(found_cnt > set->result_pairs){
+        printf("WARNING: Turn %u dropped %u collisions past the result buffer.\n",
+               work_num, found_cnt - set->result_pairs);
+        ctx->result_overflow += found_cnt - set->result_pairs;
+        found_cnt = set->result_pairs;
+        //later turns get a buffer for twice as many
+        while(ctx->result_pairs < MATCH_PAIRS && ctx->result_pairs < set->host->header[1]){
+            ctx->result_pairs = ctx->result_pairs * 2 < MATCH_PAIRS ? ctx->result_pairs * 2 : MATCH_PAIRS;
+        }
     }
 
-    cl_ulong tem;
-    int found_cnt = result[1];
-    int match_cnt = result[0];
+    if(!ReserveFound(ctx, found_cnt)){
+        return 1;
+    }
+    unsigned int prefix_cnt = found_cnt < RESULT_PREFIX_PAIRS ? found_cnt : RESULT_PREFIX_PAIRS;
+    if(prefix_cnt){
+        memcpy(ctx->found, set->host->header + 2, 2 * prefix_cnt * sizeof(cl_uint));
+    }
+    if(found_cnt > prefix_cnt){
+        //blocks behind the next queued turn, only for unusually rich turns
+        err = clEnqueueReadBuffer(ctx->cmd_queue, set->result, CL_TRUE, sizeof(set->host->header),
+                                  2 * (found_cnt - prefix_cnt) * sizeof(cl_uint),
+                                  ctx->found + 2 * prefix_cnt, 0, NULL, NULL);
+        if (CL_SUCCESS != err){
+            printf("ERROR[%d]: Failed to read %u collisions of turn %u (%s).\n",
+                   err, found_cnt, work_num, getclErrString(err));
+            return 1;
+        }
+    }
 
+    for(unsigned int k = 0; k<found_cnt; k++){
+        const cl_uint *pair = &ctx->found[k*2];
+        ctx->collisions += 2;
+        printf("Found conflict [%d]: %u(0x%08x) <-> %u(0x%08x)\n", k + 1,
+             pair[0], pair[0], pair[1], pair[1]);
 
-    for(int k = 0; k<found_cnt; k++){
-      if(result[2*k + 2]) {
-            nonce_array[k*2]=result[2*k + 2];
-            nonce_array[k*2+1]=result[2*k + 3];
+        if(g_dbg_flag &&
+           !conflict_validate(NULL, midhash, pair[0], pair[1], &tem)){
+            printf("WARNING: Device verified pair %u <-> %u failed on the host.\n",
+                   pair[0], pair[1]);
+        }
+    }
 
-        if(conflict_validate(NULL, midhash, nonce_array[k*2], nonce_array[k*2 + 1], &tem)){
-           printf("Found conflict [%d]: %u(0x%08x) <-> %u(0x%08x) bir:%llx\n", found_cnt,
-                nonce_array[k*2], nonce_array[k*2],
-                nonce_array[k*2 + 1], nonce_array[k*2 + 1], tem);
-         }
+    if(set->result_pairs < ctx->result_pairs){
+        clReleaseMemObject(set->result);
+        if(!CreateResultBuffer(ctx, set)){
+            return 1;
         }
     }
 
+    *nonce_array = ctx->found;
     *found_num = found_cnt*2;
+    ctx->turns++;
+
+    validate_stop = perf_clock::now();
+
+    if(work_num%g_stat_every_turns==0){
+        printf("[G Stat] dev %u turn latency %f ms, host wait %f ms, validate %f ms ---->\n",
+            ctx->dev_num,
+            perf_ms(set->submitted, wait_stop),
+            perf_ms(wait_start, wait_stop),
+            perf_ms(wait_stop, validate_stop));
+    }
 
     if(g_dbg_flag){ //(work_num%g_stat_every_turns==0){
         printf("Work %d found val/match :%d/%d\n", work_num, found_cnt, match_cnt);
     }
 
-    cl_int err = clEnqueueUnmapMemObject(g_cmd_queue, g_result, result, 0, NULL, NULL);
+    return 0;
+}
+
+//one turn start to end, nothing overlapped
+int match_birthday_gpu_alg(MinerContext *ctx, unsigned int work_num,
+                        cl_int map_size, const unsigned char* midhash,
+                        const unsigned int **nonce_array, unsigned int *found_num)
+{
+    if(gpu_turn_submit(ctx, work_num, map_size, midhash)){
+        return 1;
+    }
+    return gpu_turn_collect(ctx, work_num, nonce_array, found_num);
+}
+
+// -------------------------------------
+// BITMAP FILTER MODE
+// -------------------------------------
+
+static bool SetBitmapKernelArg(MinerContext *ctx, int id, cl_uint index, size_t size, const void *value)
+{
+    cl_int err = clSetKernelArg(ctx->bitmap_kernels[id], index, size, value);
+    if (err != CL_SUCCESS){
+        printf("ERROR[%d]: Failed to set %s kernel argument %u. (%s)\n",
+               err, bitmap_kernel_name(ctx, id), index, getclErrString(err));
+        return false;
+    }
+    return true;
+}
+
+//no local size: list lengths are not a multiple of any work group size
+static bool EnqueueBitmapKernel(MinerContext *ctx, int id, size_t gsz)
+{
+    if(gsz == 0){
+        return true;
+    }
 
+    cl_int err = clEnqueueNDRangeKernel(ctx->cmd_queue, ctx->bitmap_kernels[id], 1,
+                                        NULL, &gsz, NULL, 0, NULL, NULL);
     if (CL_SUCCESS != err){
-        printf("ERROR[%d]: Failed to map result buffer (%s).\n", err, getclErrString(err));
+        printf("ERROR[%d]: Failed to execute %s kernel (%s).\n",
+               err, bitmap_kernel_name(ctx, id), getclErrString(err));
         return false;
     }
+    return true;
+}
 
-    return 0;
+//midhash and the bitmap buffer(s), *next is the first phase specific argument
+static bool SetBitmapKernelMaps(MinerContext *ctx, int id, cl_uint *next)
+{
+    cl_uint index = 0;
+
+    if(!SetBitmapKernelArg(ctx, id, index++, sizeof(cl_mem), &ctx->midhash) ||
+       !SetBitmapKernelArg(ctx, id, index++, sizeof(cl_mem), &ctx->inputBuffer)){
+        return false;
+    }
+    if(ctx->bitmap_2buf && !SetBitmapKernelArg(ctx, id, index++, sizeof(cl_mem), &ctx->inputBuffer2)){
+        return false;
+    }
+    *next = index;
+    return true;
 }
 
+static bool ZeroBitmap(MinerContext *ctx, unsigned int map_size)
+{
+    if(ctx->bitmap_2buf){
+        //_2buf_zeroBitmap clears the same float8 in both halves
+        return SetBitmapKernelArg(ctx, BK_ZERO, 0, sizeof(cl_mem), &ctx->inputBuffer) &&
+               SetBitmapKernelArg(ctx, BK_ZERO, 1, sizeof(cl_mem), &ctx->inputBuffer2) &&
+               EnqueueBitmapKernel(ctx, BK_ZERO, map_size / (16 * sizeof(cl_float)));
+    }
+    return SetBitmapKernelArg(ctx, BK_ZERO, 0, sizeof(cl_mem), &ctx->inputBuffer) &&
+           EnqueueBitmapKernel(ctx, BK_ZERO, map_size / (8 * sizeof(cl_float)));
+}
 
-void clean(int ret)
+static bool ResetListCount(MinerContext *ctx, cl_mem list)
 {
-    printf("[Exiting]Releasing resources...\n");
-    Cleanup_OpenCL();
-    exit(ret);
+    cl_uint zero = 0;
+    cl_int err = clEnqueueFillBuffer(ctx->cmd_queue, list, &zero, sizeof(cl_uint), 0,
+                                     sizeof(cl_uint), 0, NULL, NULL);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to reset bitmap list counter. (%s)\n",
+               err, getclErrString(err));
+        return false;
+    }
+    return true;
 }
 
-#define SELF_TEST
-#ifdef SELF_TEST
+//blocking, the next phase's global size depends on it
+static bool ReadListCount(MinerContext *ctx, cl_mem list, cl_uint *count)
+{
+    cl_int err = clEnqueueReadBuffer(ctx->cmd_queue, list, CL_TRUE, 0, sizeof(cl_uint),
+                                     count, 0, NULL, NULL);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to read bitmap list counter. (%s)\n",
+               err, getclErrString(err));
+        return false;
+    }
+    return true;
+}
 
-static unsigned int g_work_num = 0;
-static int g_work_finished = 0;
-static int g_work_started = 0;
+/*
+Phase 1 lists hashes hitting a set bit, phase 2 marks only those, phase 3
+keeps every hash that hits them: the domain holds both sides of each
+collision. Phases 4..6 repeat that on the domain with rotated birthday
+bits until it is small enough to be resolved exactly on the host.
+*/
+static bool RunBitmapFilter(MinerContext *ctx, unsigned int map_size, cl_uint *domain_count,
+                            int *domain_id, unsigned int *phase_counts,
+                            unsigned int *rounds)
+{
+    cl_uint list_count = 0;
+    cl_uint count = 0;
+    int cur = 0;
 
-static unsigned int g_test_arraySize = 0;
+    if(!ZeroBitmap(ctx, map_size) || !ResetListCount(ctx, ctx->bitmap_list) ||
+       !ResetListCount(ctx, ctx->bitmap_domain[cur])){
+        return false;
+    }
 
-int main(int argc, _TCHAR* argv[])
-{
-    cl_uint dev_alignment = 128;
-    //cl_bool sortAscending = true;
+    for(int id = BK_PHASE1; id <= BK_PHASE3; id++){
+        cl_mem list = (id == BK_PHASE3) ? ctx->bitmap_domain[cur] : ctx->bitmap_list;
+        cl_uint arg;
+        if(!SetBitmapKernelMaps(ctx, id, &arg) ||
+           !SetBitmapKernelArg(ctx, id, arg, sizeof(cl_mem), &list)){
+            return false;
+        }
+    }
 
-    cl_int arraySize = (1 << NONCE_BITS);
+    if(!EnqueueBitmapKernel(ctx, BK_PHASE1, BITMAP_HASHES_PER_TURN) ||
+       !ReadListCount(ctx, ctx->bitmap_list, &list_count) ||
+       !ZeroBitmap(ctx, map_size) ||
+       !EnqueueBitmapKernel(ctx, BK_PHASE2, list_count) ||
+       !EnqueueBitmapKernel(ctx, BK_PHASE3, BITMAP_HASHES_PER_TURN) ||
+       !ReadListCount(ctx, ctx->bitmap_domain[cur], &count)){
+        return false;
+    }
+    phase_counts[0] = list_count;
+    phase_counts[1] = count;
 
-    g_conflict_map_size = 256 * (1<<20);
+    *rounds = 0;
+    while(*rounds < BITMAP_FILTER_ROUNDS && count > BITMAP_HOST_DOMAIN){
+        cl_uint rotateN = (*rounds + 1) * BITMAP_ROTATE_STEP % SEARCH_SPACE_BITS;
+        cl_uint next_count = 0;
+        int next = cur ^ 1;
+
+        if(!ZeroBitmap(ctx, map_size) || !ResetListCount(ctx, ctx->bitmap_list) ||
+           !ResetListCount(ctx, ctx->bitmap_domain[next])){
+            return false;
+        }
+
+        cl_uint a4, a5, a6;
+        if(!SetBitmapKernelMaps(ctx, BK_PHASE4, &a4) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE4, a4, sizeof(cl_mem), &ctx->bitmap_domain[cur]) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE4, a4 + 1, sizeof(cl_mem), &ctx->bitmap_list) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE4, a4 + 2, sizeof(cl_uint), &rotateN) ||
+           !SetBitmapKernelMaps(ctx, BK_PHASE5, &a5) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE5, a5, sizeof(cl_mem), &ctx->bitmap_list) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE5, a5 + 1, sizeof(cl_uint), &rotateN) ||
+           !SetBitmapKernelMaps(ctx, BK_PHASE6, &a6) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE6, a6, sizeof(cl_mem), &ctx->bitmap_domain[cur]) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE6, a6 + 1, sizeof(cl_mem), &ctx->bitmap_domain[next]) ||
+           !SetBitmapKernelArg(ctx, BK_PHASE6, a6 + 2, sizeof(cl_uint), &rotateN)){
+            return false;
+        }
+
+        if(!EnqueueBitmapKernel(ctx, BK_PHASE4, count) ||
+           !ReadListCount(ctx, ctx->bitmap_list, &list_count) ||
+           !ZeroBitmap(ctx, map_size) ||
+           !EnqueueBitmapKernel(ctx, BK_PHASE5, list_count) ||
+           !EnqueueBitmapKernel(ctx, BK_PHASE6, count) ||
+           !ReadListCount(ctx, ctx->bitmap_domain[next], &next_count)){
+            return false;
+        }
+
+        (*rounds)++;
+        phase_counts[1 + *rounds] = next_count;
+        cur = next;
+        if(next_count == count){
+            break; //bitmap too small to shrink it further
+        }
+        count = next_count;
+    }
+
+    *domain_count = phase_counts[1 + *rounds];
+    *domain_id = cur;
+    return true;
+}
+
+struct bitmap_birthday {
+    uint64 birthday;
+    uint32 nonce;
+};
+
+static int cmp_bitmap_birthday(const void *a, const void *b)
+{
+    const struct bitmap_birthday *x = (const struct bitmap_birthday *)a;
+    const struct bitmap_birthday *y = (const struct bitmap_birthday *)b;
+    if(x->birthday != y->birthday)
+        return (x->birthday > y->birthday) - (x->birthday < y->birthday);
+    //a nonce listed twice in the domain lands next to its copy
+    return (x->nonce > y->nonce) - (x->nonce < y->nonce);
+}
+
+
+int match_birthday_bitmap_alg(MinerContext *ctx, unsigned int work_num,
+                        cl_int map_size, const unsigned char* midhash,
+                        const unsigned int **nonce_array, unsigned int *found_num)
+{
+    unsigned int phase_counts[2 + BITMAP_FILTER_ROUNDS];
+    unsigned int rounds = 0;
+    cl_uint domain_count = 0;
+    int domain_id = 0;
+    perf_clock::time_point filter_start, filter_stop;
+
+    if(!WriteMidhashBuffer(ctx, midhash)){
+        return 1;
+    }
+
+    filter_start = perf_clock::now();
+
+    if(!RunBitmapFilter(ctx, map_size, &domain_count, &domain_id, phase_counts, &rounds)){
+        return 1;
+    }
+
+    //domain, then its birthdays, in host memory kept across turns
+    size_t domain_bytes = ((domain_count + 1) * sizeof(cl_uint) + 15) & ~(size_t)15;
+    size_t scratch = domain_bytes + (size_t)domain_count * BIRTHDAYS_PER_HASH * sizeof(struct bitmap_birthday);
+    if(scratch > ctx->bitmap_scratch_size){
+        void *p = realloc(ctx->bitmap_scratch, scratch);
+        if(p == NULL){
+            printf("ERROR: Failed to allocate %u bitmap domain entries.\n", domain_count);
+            return 1;
+        }
+        ctx->bitmap_scratch = p;
+        ctx->bitmap_scratch_size = scratch;
+    }
+    cl_uint *domain = (cl_uint *)ctx->bitmap_scratch;
+    struct bitmap_birthday *bdays = (struct bitmap_birthday *)((char *)ctx->bitmap_scratch + domain_bytes);
+
+    cl_int err = clEnqueueReadBuffer(ctx->cmd_queue, ctx->bitmap_domain[domain_id], CL_TRUE, 0,
+                                     (domain_count + 1) * sizeof(cl_uint), domain, 0, NULL, NULL);
+    if (CL_SUCCESS != err){
+        printf("ERROR[%d]: Failed to read bitmap domain (%s).\n", err, getclErrString(err));
+        return 1;
+    }
+
+    filter_stop = perf_clock::now();
+
+    //exact 50 bit birthdays of what survived the filter, hashed from a
+    //cached copy rather than the mapping
+    sha512_birthday_ctx inp = *ctx->midhash_host;
+    unsigned int n = 0;
+    for(unsigned int k = 0; k < domain_count; k++){
+        uint32 nonce = domain[k + 1];
+        uint64 digest[8];
+        sha512_birthday(&inp, &nonce, digest);
+        for(unsigned int i = 0; i < BIRTHDAYS_PER_HASH; i++){
+            bdays[n].birthday = digest[i] >> (64 - SEARCH_SPACE_BITS);
+            bdays[n].nonce = nonce + i;
+            n++;
+        }
+    }
+    qsort(bdays, n, sizeof(struct bitmap_birthday), cmp_bitmap_birthday);
+
+    uint64 tem;
+    unsigned int found_cnt = 0;
+    for(unsigned int first = 0, k = 1; k < n; k++){
+        if(bdays[k].birthday != bdays[first].birthday){
+            first = k;
+            continue;
+        }
+        if(bdays[k].nonce == bdays[k - 1].nonce){
+            continue;   //same nonce again, not a pair
+        }
+        if(!conflict_validate(NULL, midhash, bdays[first].nonce, bdays[k].nonce, &tem)){
+            continue;
+        }
+        if(!ReserveFound(ctx, found_cnt + 1)){
+            return 1;
+        }
+        ctx->found[found_cnt*2] = bdays[first].nonce;
+        ctx->found[found_cnt*2 + 1] = bdays[k].nonce;
+        ctx->collisions += 2;
+        printf("Found conflict [%d]: %u(0x%08x) <-> %u(0x%08x) bir:%llx\n", found_cnt + 1,
+            bdays[first].nonce, bdays[first].nonce,
+            bdays[k].nonce, bdays[k].nonce, tem);
+        found_cnt++;
+    }
+    *nonce_array = ctx->found;
+    *found_num = found_cnt*2;
+    ctx->turns++;
+
+
+    if(work_num%g_stat_every_turns==0){
+        printf("[B Stat] dev %u filter time %f ms, list %u, domain %u", ctx->dev_num,
+            perf_ms(filter_start, filter_stop),
+            phase_counts[0], phase_counts[1]);
+        for(unsigned int r = 1; r <= rounds; r++){
+            printf(" -> %u", phase_counts[1 + r]);
+        }
+        printf(" ---->\n");
+    }
+
+    if(g_dbg_flag){
+        printf("Work %d found val :%d\n", work_num, found_cnt);
+    }
+
+    return 0;
+}
+
+
+MinerContext *miner_context_create(unsigned int platform_num,
+                                   enum device_types dev_type, unsigned int dev_num,
+                                   enum gpu_algos algo, enum gpu_modes mode,
+                                   unsigned int map_size, unsigned int work_size)
+{
+    MinerContext *ctx = new (std::nothrow) MinerContext(); //zeroed
+    if(ctx == NULL){
+        printf("ERROR: Failed to create miner context for device %u.\n", dev_num);
+        return NULL;
+    }
+    ctx->platform_num = platform_num;
+    ctx->dev_type = dev_type;
+    ctx->dev_num = dev_num;
+    ctx->turn_prof = true;
+    ctx->algo = algo;
+    ctx->gpu_mode = mode;
+    ctx->map_size = map_size;
+    ctx->work_size = work_size;
+    return ctx;
+}
+
+int miner_context_init(MinerContext *ctx, const char *program_source)
+{
+    cl_uint dev_alignment = 128;
+    const unsigned int map_size = ctx->map_size;   //as asked, Setup_OpenCL may split it
+
+    for(;;){
+        //later devices of the same model load the kernel binary the first one cached
+        if( 0 != Setup_OpenCL(ctx, program_source, &dev_alignment, map_size,
+                               ctx->algo, ctx->platform_num, ctx->dev_num, 1) )
+            return -1;
+
+        if(initGPUBuffer(ctx, ctx->map_size) == 0)
+            return 0;
+
+        //memory taken by others: half the table, twice the passes
+        if(ctx->gpu_mode != MODE_TABLE || ctx->table_passes >= TABLE_PASSES_MAX)
+            return -1;
+        ctx->mem_budget = ctx->map_size / 2;
+        Cleanup_OpenCL(ctx);
+        printf("[Info] Retrying device %u with a %u MB table budget.\n",
+               ctx->dev_num, (unsigned int)(ctx->mem_budget>>20));
+    }
+}
+
+void miner_context_set_mem_budget(MinerContext *ctx, unsigned int mem_budget)
+{
+    ctx->mem_budget = mem_budget;
+}
+
+void miner_context_destroy(MinerContext *ctx)
+{
+    if(ctx == NULL)
+        return;
+    Cleanup_OpenCL(ctx);
+    free(ctx->found);
+    free(ctx->bitmap_scratch);
+    delete ctx;
+}
+
+void miner_context_stats(const MinerContext *ctx, miner_stats *stats)
+{
+    stats->collisions = ctx->collisions;
+    stats->match_overflow = ctx->match_overflow;
+    stats->result_overflow = ctx->result_overflow;
+    stats->turns = ctx->turns;
+    stats->busy_ms = ctx->busy_us / 1000.0;
+}
+
+
+//contexts of the devices being mined on, released by clean()
+static MinerContext *g_contexts[MAX_GPU_NUM];
+static unsigned int g_context_count = 0;
+
+void clean(int ret)
+{
+    printf("[Exiting]Releasing resources...\n");
+    for(unsigned int i = 0; i < g_context_count; i++){
+        miner_context_destroy(g_contexts[i]);
+        g_contexts[i] = NULL;
+    }
+    cpu_miner_cleanup();
+    exit(ret);
+}
+
+//deterministic midhash of test turn work_num
+static void test_midhash(unsigned int work_num, unsigned char *midhash)
+{
+    unsigned char block[80];
+    memset(block, 0, 80);
+    block[0] = work_num;
+
+    sha256_ctx c256;
+    sha256_init(&c256);
+    sha256_update(&c256, (unsigned char*)block, 80);
+    sha256_final(&c256, midhash);
+    sha256_init(&c256);
+    sha256_update(&c256, (unsigned char*)midhash, 32);
+    sha256_final(&c256, midhash);
+}
+
+// -------------------------------------
+// AUTOTUNE
+// -------------------------------------
+
+/*
+--autotune sweeps algorithm, table size and work-group size in table mode
+over the same benchmark midhashes and keeps the best collisions/min of the
+device in TUNE_FILE, one line per device identity (platform, device name,
+driver). Later runs load it for every knob not given on the command line.
+
+A turn only finds about two pairs, far too few to rank configurations on.
+The work-group size does not change which pairs a table keeps, only how
+fast a turn runs, so it is picked on turn time alone over TUNE_TIME_TURNS.
+The yield of each algorithm and table size is then counted once over
+TUNE_YIELD_TURNS with the fastest work size, and the score is
+pairs per turn * turns per minute.
+*/
+#define TUNE_FILE           "ominer_tune.txt"
+#define TUNE_TIME_TURNS     8       //benchmark midhashes per work size
+#define TUNE_YIELD_TURNS    128     //benchmark midhashes per table
+#define TUNE_IDENT_SIZE     800
+
+static const enum gpu_algos tune_algos[] = { GEN, GEEKJ, KISS };
+static const unsigned int tune_map_sizes[] = { 128, 256, 512, 1024 }; //MB
+static const unsigned int tune_work_sizes[] = { 64, 128, 256 };
+
+typedef struct {
+    unsigned int algo;
+    unsigned int map_mb;
+    unsigned int work_size;
+    float rate;                     //collisions per minute
+} tune_config;
+
+static bool GetDeviceIdent(unsigned int platform_num, enum device_types dev_type,
+                           unsigned int dev_num, char *ident, size_t size)
+{
+    cl_device_id devices[MAX_GPU_NUM];
+    cl_uint num = 0;
+    char info[3][256];
+    cl_int err = CL_SUCCESS;
+
+    cl_platform_id platform = GetOCLPlatform(platform_num);
+    if(platform == NULL){
+        return false;
+    }
+    num = GetOCLDevices(platform, dev_type, devices);
+    if(dev_num >= num){
+        return false;
+    }
+
+    memset(info, 0, sizeof(info));
+    err |= clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(info[0]) - 1, info[0], NULL);
+    err |= clGetDeviceInfo(devices[dev_num], CL_DEVICE_NAME, sizeof(info[1]) - 1, info[1], NULL);
+    err |= clGetDeviceInfo(devices[dev_num], CL_DRIVER_VERSION, sizeof(info[2]) - 1, info[2], NULL);
+    if(err != CL_SUCCESS){
+        return false;
+    }
+
+    snprintf(ident, size, "%s|%s|%s", info[0], info[1], info[2]);
+    return true;
+}
+
+//line: algo map_mb work_size rate ident
+static bool LoadTuning(const char *ident, tune_config *cfg)
+{
+    char line[TUNE_IDENT_SIZE + 64];
+    bool found = false;
+
+    FILE *file = fopen(TUNE_FILE, "r");
+    if(!file){
+        return false;
+    }
+    while(!found && fgets(line, sizeof(line), file)){
+        int pos = 0;
+        line[strcspn(line, "\r\n")] = 0;
+        if(sscanf(line, "%u %u %u %f %n", &cfg->algo, &cfg->map_mb,
+                  &cfg->work_size, &cfg->rate, &pos) == 4 && pos > 0){
+            found = strcmp(line + pos, ident) == 0;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+//rewrite the file with this device's line replaced
+static bool SaveTuning(const char *ident, const tune_config *cfg)
+{
+    char line[TUNE_IDENT_SIZE + 64];
+    const char *tmpname = TUNE_FILE ".tmp";
+
+    FILE *out = fopen(tmpname, "w");
+    if(!out){
+        printf("WARNING: Failed to write tuning file '%s'.\n", tmpname);
+        return false;
+    }
+
+    FILE *in = fopen(TUNE_FILE, "r");
+    if(in){
+        while(fgets(line, sizeof(line), in)){
+            tune_config old;
+            int pos = 0;
+            char *end = line + strcspn(line, "\r\n");
+            char saved = *end;
+            *end = 0;
+            bool same = sscanf(line, "%u %u %u %f %n", &old.algo, &old.map_mb,
+                               &old.work_size, &old.rate, &pos) == 4 &&
+                        pos > 0 && strcmp(line + pos, ident) == 0;
+            *end = saved;
+            if(!same){
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%u %u %u %.2f %s\n", cfg->algo, cfg->map_mb,
+            cfg->work_size, cfg->rate, ident);
+    if(fclose(out) != 0){
+        printf("WARNING: Failed to write tuning file '%s'.\n", tmpname);
+        remove(tmpname);
+        return false;
+    }
+
+    remove(TUNE_FILE);
+    if(rename(tmpname, TUNE_FILE) != 0){
+        printf("WARNING: Failed to rename tuning file '%s'.\n", tmpname);
+        remove(tmpname);
+        return false;
+    }
+    return true;
+}
+
+static int TuneSetup(MinerContext *ctx, unsigned int platform_num, unsigned int dev_num,
+                     unsigned int algo, unsigned int map_mb)
+{
+    ctx->bitmap_2buf = false;
+    ctx->gpu_mode = MODE_TABLE;
+
+    if(Setup_OpenCL(ctx, "momentum_miner.cl", NULL, map_mb << 20, algo,
+                    platform_num, dev_num, 0)){
+        Cleanup_OpenCL(ctx);
+        return 1;
+    }
+    if(ctx->bitmap_2buf || ctx->table_passes > 1){
+        printf("[Tune] %u MB table exceeds the max allocation, skipped.\n", map_mb);
+        Cleanup_OpenCL(ctx);
+        return 1;
+    }
+    if(initGPUBuffer(ctx, map_mb << 20)){
+        Cleanup_OpenCL(ctx);
+        return 1;
+    }
+    return 0;
+}
+
+//ms per turn over the first turns benchmark midhashes, negative on failure
+static float TuneMeasure(MinerContext *ctx, unsigned int map_size, unsigned int turns,
+                         unsigned int *collisions)
+{
+    unsigned char midhash[32];
+    const unsigned int *nonces;
+    unsigned int found = 0;
+    perf_clock::time_point start, stop;
+
+    //warm up, the first turn also clears the table
+    test_midhash(0, midhash);
+    if(match_birthday_gpu_alg(ctx, 0, map_size, midhash, &nonces, &found)){
+        return -1;
+    }
+
+    unsigned int before = ctx->collisions;
+    start = perf_clock::now();
+
+    test_midhash(1, midhash);
+    if(gpu_turn_submit(ctx, 1, map_size, midhash)){
+        return -1;
+    }
+    for(unsigned int i = 1; i <= turns; i++){
+        if(i < turns){
+            test_midhash(i + 1, midhash);
+            if(gpu_turn_submit(ctx, i + 1, map_size, midhash)){
+                return -1;
+            }
+        }
+        if(gpu_turn_collect(ctx, i, &nonces, &found)){
+            return -1;
+        }
+    }
+
+    stop = perf_clock::now();
+
+    float ms = perf_ms(start, stop);
+    *collisions = ctx->collisions - before;
+    return ms / turns;
+}
+
+int gpu_autotune(MinerContext *ctx)
+{
+    unsigned int platform_num = ctx->platform_num;
+    unsigned int dev_num = ctx->dev_num;
+    char ident[TUNE_IDENT_SIZE];
+    tune_config best;
+    memset(&best, 0, sizeof(best));
+
+    if(!GetDeviceIdent(platform_num, ctx->dev_type, dev_num, ident, sizeof(ident))){
+        printf("ERROR: Failed to identify platform %u device %u for tuning.\n",
+               platform_num, dev_num);
+        return 1;
+    }
+    printf("[Tune] Tuning %s ...\n", ident);
+
+    for(unsigned int a = 0; a < sizeof(tune_algos)/sizeof(tune_algos[0]); a++){
+        if(a > 0 && !ctx->amd_GPU){
+            printf("[Tune] Algorithm variants only differ on AMD devices, '%s' kept.\n",
+                   gpu_algo_names[tune_algos[0]]);
+            break;
+        }
+        for(unsigned int s = 0; s < sizeof(tune_map_sizes)/sizeof(tune_map_sizes[0]); s++){
+            unsigned int map_mb = tune_map_sizes[s];
+            if(TuneSetup(ctx, platform_num, dev_num, tune_algos[a], map_mb)){
+                continue;
+            }
+
+            unsigned int collisions;
+            unsigned int fastest = 0;
+            float fastest_ms = 0;
+            for(unsigned int w = 0; w < sizeof(tune_work_sizes)/sizeof(tune_work_sizes[0]); w++){
+                ctx->work_size = tune_work_sizes[w];
+                float turn_ms = TuneMeasure(ctx, map_mb << 20, TUNE_TIME_TURNS, &collisions);
+                if(turn_ms < 0){
+                    //larger groups will not fit either
+                    printf("[Tune] Work size %u failed, skipped.\n", ctx->work_size);
+                    break;
+                }
+
+                printf("[Tune] algo %s, %u MB, work size %u: %.3f ms/turn\n",
+                       gpu_algo_names[tune_algos[a]], map_mb, ctx->work_size, turn_ms);
+                if(fastest == 0 || turn_ms < fastest_ms){
+                    fastest = ctx->work_size;
+                    fastest_ms = turn_ms;
+                }
+            }
+
+            if(fastest){
+                ctx->work_size = fastest;
+                float turn_ms = TuneMeasure(ctx, map_mb << 20, TUNE_YIELD_TURNS, &collisions);
+                if(turn_ms > 0){
+                    float rate = (float)collisions / TUNE_YIELD_TURNS * 60000.0f / turn_ms;
+                    printf("[Tune] algo %s, %u MB, work size %u: %.3f collisions/turn, %.2f collisions/min\n",
+                           gpu_algo_names[tune_algos[a]], map_mb, fastest,
+                           (float)collisions / TUNE_YIELD_TURNS, rate);
+                    if(rate > best.rate){
+                        best.algo = tune_algos[a];
+                        best.map_mb = map_mb;
+                        best.work_size = fastest;
+                        best.rate = rate;
+                    }
+                }
+            }
+            Cleanup_OpenCL(ctx);
+        }
+    }
+
+    if(best.rate <= 0){
+        printf("ERROR: No configuration found a collision on platform %u device %u.\n",
+               platform_num, dev_num);
+        return 1;
+    }
+
+    printf("[Tune] Best: algo %s, %u MB, work size %u, %.2f collisions/min\n",
+           gpu_algo_names[best.algo], best.map_mb, best.work_size, best.rate);
+    if(SaveTuning(ident, &best)){
+        printf("[Tune] Saved to %s\n", TUNE_FILE);
+    }
+    return 0;
+}
+
+/*
+Apply the saved tuning of the context's device to the knobs the user did
+not set. Only table mode was tuned.
+*/
+static void ApplyTuning(MinerContext *ctx,
+                        bool set_algo, bool set_size, bool set_work_size)
+{
+    char ident[TUNE_IDENT_SIZE];
+    tune_config cfg;
+
+    if(ctx->gpu_mode != MODE_TABLE || (set_algo && set_size && set_work_size)){
+        return;
+    }
+    if(!GetDeviceIdent(ctx->platform_num, ctx->dev_type, ctx->dev_num, ident, sizeof(ident)) ||
+       !LoadTuning(ident, &cfg)){
+        return;
+    }
+    if(cfg.algo > GEN || cfg.map_mb == 0 || (cfg.map_mb & (cfg.map_mb - 1)) ||
+       cfg.work_size == 0){
+        printf("WARNING: Ignored bad tuning entry in %s.\n", TUNE_FILE);
+        return;
+    }
+
+    if(!set_algo)
+        ctx->algo = (enum gpu_algos)cfg.algo;
+    if(!set_size)
+        ctx->map_size = cfg.map_mb << 20;
+    if(!set_work_size)
+        ctx->work_size = cfg.work_size;
+    printf("[Info] Device %u loaded tuning from %s: algo %s, %u MB, work size %u.\n",
+           ctx->dev_num, TUNE_FILE, gpu_algo_names[ctx->algo],
+           ctx->map_size>>20, ctx->work_size);
+}
+
+#define SELF_TEST
+#ifdef SELF_TEST
+
+static unsigned int g_work_num = 0;
+
+static unsigned int g_test_arraySize = 0;
+
+//-d 0, -d 0,2,3 or -d all, which is counted once the platform is known
+static unsigned int g_dev_nums[MAX_GPU_NUM];
+static unsigned int g_device_count = 1;
+
+static bool ParseDeviceList(const char *arg)
+{
+    g_device_count = 0;
+    if(strcmp(arg, "all") == 0){
+        return true;
+    }
+    for(;;){
+        char *end;
+        unsigned long num = strtoul(arg, &end, 10);
+        if(end == arg || g_device_count >= MAX_GPU_NUM){
+            return false;
+        }
+        g_dev_nums[g_device_count++] = num;
+        if(*end == 0){
+            return true;
+        }
+        if(*end != ','){
+            return false;
+        }
+        arg = end + 1;
+    }
+}
+
+static enum device_types g_device_type = DEVICE_GPU;
+static const char *g_device_name = NULL;    //--device-name substring
+static const char *g_platform_name = NULL;  //-p given as a name substring
+
+static bool ParseDeviceType(const char *arg)
+{
+    for(unsigned int t = 0; t < sizeof(device_type_names)/sizeof(device_type_names[0]); t++){
+        if(strcmp(arg, device_type_names[t]) == 0){
+            g_device_type = (enum device_types)t;
+            return true;
+        }
+    }
+    return false;
+}
+
+//-p by name: index of the first platform whose name contains it, -1 if none
+static int FindOCLPlatform(const char *name)
+{
+    cl_platform_id platforms[10];
+    char platform_name[256];
+    cl_uint count = 0;
+
+    if(clGetPlatformIDs(10, platforms, &count) != CL_SUCCESS){
+        return -1;
+    }
+    for(cl_uint p = 0; p < count && p < 10; p++){
+        memset(platform_name, 0, sizeof(platform_name));
+        clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(platform_name) - 1,
+                          platform_name, NULL);
+        if(strstr(platform_name, name)){
+            return p;
+        }
+    }
+    return -1;
+}
+
+/*
+Fill g_dev_nums with the devices of g_device_type to mine on: the -d list,
+or every one for -d all, less those whose name lacks --device-name.
+*/
+static unsigned int SelectDevices(unsigned int platform_num)
+{
+    cl_device_id devices[MAX_GPU_NUM];
+    cl_platform_id platform = GetOCLPlatform(platform_num);
+    cl_uint num = platform ? GetOCLDevices(platform, g_device_type, devices) : 0;
+
+    if(g_device_count == 0){
+        for(cl_uint i = 0; i < num; i++)
+            g_dev_nums[i] = i;
+        g_device_count = num;
+    }
+    if(g_device_name == NULL){
+        return g_device_count;
+    }
+
+    unsigned int kept = 0;
+    for(unsigned int i = 0; i < g_device_count; i++){
+        char dev_name[256] = { 0 };
+        if(g_dev_nums[i] >= num)
+            continue;
+        clGetDeviceInfo(devices[g_dev_nums[i]], CL_DEVICE_NAME, sizeof(dev_name) - 1, dev_name, NULL);
+        if(strstr(dev_name, g_device_name))
+            g_dev_nums[kept++] = g_dev_nums[i];
+    }
+    g_device_count = kept;
+    return kept;
+}
+
+static void ListDevices(void)
+{
+    cl_platform_id platforms[10];
+    cl_uint count = 0;
+    cl_int err = clGetPlatformIDs(10, platforms, &count);
+
+    if(err != CL_SUCCESS){
+        printf("ERROR[%d]: Failed to get opencl platform ids . (%s) \n",
+               err, getclErrString(err));
+        return;
+    }
+    for(cl_uint p = 0; p < count && p < 10; p++){
+        char info[256] = { 0 };
+        clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(info) - 1, info, NULL);
+        printf("Platform %u: %s\n", p, info);
+
+        for(int t = DEVICE_GPU; t < DEVICE_ALL; t++){
+            cl_device_id devices[MAX_GPU_NUM];
+            cl_uint num = GetOCLDevices(platforms[p], (enum device_types)t, devices);
+
+            for(cl_uint d = 0; d < num; d++){
+                char name[256] = { 0 }, vendor[256] = { 0 }, version[256] = { 0 }, driver[256] = { 0 };
+                cl_uint units = 0, clock = 0, vec_long = 0;
+                cl_ulong global_mem = 0, max_alloc = 0, local_mem = 0;
+                size_t max_group = 0;
+
+                clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_VENDOR, sizeof(vendor) - 1, vendor, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_VERSION, sizeof(version) - 1, version, NULL);
+                clGetDeviceInfo(devices[d], CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock), &clock, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG,
+                                sizeof(vec_long), &vec_long, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+                clGetDeviceInfo(devices[d], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+
+                printf("  %s %u: %s (%s)\n", device_type_names[t], d, name, vendor);
+                printf("      %s, driver %s\n", version, driver);
+                printf("      %u compute units @ %u MHz, max work group %u, long vector width %u\n",
+                       units, clock, (unsigned int)max_group, vec_long);
+                printf("      global %u MB, max alloc %u MB, local %u KB\n",
+                       (unsigned int)(global_mem>>20), (unsigned int)(max_alloc>>20),
+                       (unsigned int)(local_mem>>10));
+            }
+        }
+    }
+}
+
+/*
+Devices share the turn numbers: each worker takes the next one until
+g_last_work, so a faster card simply mines more turns.
+*/
+static std::atomic<unsigned int> g_next_work(0);
+static unsigned int g_last_work = 0;
+static perf_clock::time_point g_run_start;
+
+static void test_turn_midhash(MinerContext *ctx, unsigned int work_num, unsigned char *midhash)
+{
+    test_midhash(work_num, midhash);
+    printf("test new mid hash[%d] dev %u: %02x%02x %02x%02x ...  %02x%02x  %02x%02x\n",
+           work_num, ctx->dev_num, midhash[0], midhash[1], midhash[2], midhash[3],
+           midhash[28], midhash[29], midhash[30], midhash[31]);
+}
+
+static void print_device_rates(MinerContext *ctx, unsigned int work_num)
+{
+    perf_clock::time_point now = perf_clock::now();
+    double wall_ms = perf_ms(g_run_start, now);
+
+    miner_stats stats;
+    miner_context_stats(ctx, &stats);
+    printf("[Perf]<---Dev %u work %u end. [conflicts:%u, meter:%.2f conflicts/min, runing:%.2f h].\n",
+           ctx->dev_num, work_num, stats.collisions,
+           stats.busy_ms > 0 ? stats.collisions*60000.0/stats.busy_ms : 0.0,
+           stats.busy_ms/3600000.0);
+    if(g_context_count > 1){
+        unsigned int total = 0;
+        for(unsigned int i = 0; i < g_context_count; i++){
+            miner_context_stats(g_contexts[i], &stats);
+            total += stats.collisions;
+        }
+        printf("[Perf] All %u devices: [conflicts:%u, meter:%.2f conflicts/min].\n",
+               g_context_count, total, total*60000.0/wall_ms);
+    }
+}
+
+static void gpu_device_worker(MinerContext *ctx, int *ret)
+{
+    unsigned char midhash[32];
+    const unsigned int *match_nonce;
+    unsigned int match_num = 0;
+    perf_clock::time_point start, stop;
+    bool table = ctx->gpu_mode == MODE_TABLE;
+
+    *ret = 0;
+
+    //table mode keeps the next turn queued while this one is validated
+    unsigned int next = g_next_work++;
+    if(table && next < g_last_work){
+        test_turn_midhash(ctx, next, midhash);
+        *ret = gpu_turn_submit(ctx, next, ctx->map_size, midhash);
+    }
+
+    while(*ret == 0 && next < g_last_work){
+        unsigned int i = next;
+
+        start = perf_clock::now();
+        if(table){
+            next = g_next_work++;
+            if(next < g_last_work){
+                test_turn_midhash(ctx, next, midhash);
+                *ret = gpu_turn_submit(ctx, next, ctx->map_size, midhash);
+            }
+            if(*ret == 0)
+                *ret = gpu_turn_collect(ctx, i, &match_nonce, &match_num);
+        }
+        else{
+            test_turn_midhash(ctx, i, midhash);
+            *ret = match_birthday_bitmap_alg(ctx, i, ctx->map_size, midhash, &match_nonce, &match_num);
+            next = g_next_work++;
+        }
+        stop = perf_clock::now();
+
+        if(*ret){
+            printf("[Error]Failed to execute gpu kernel on device %u: %d\n", ctx->dev_num, *ret);
+            break;
+        }
+        if(g_dbg_flag)
+            printf("Return conflicts: %d\n", match_num);
+
+        ctx->busy_us += (unsigned long long)(1000.0*perf_ms(start, stop));
+        if(i%g_stat_every_turns==0){
+            print_device_rates(ctx, i);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    //cl_bool sortAscending = true;
+
+    cl_int arraySize = (1 << NONCE_BITS);
+    bool autotune = false;
+    bool list_devices = false;
+    bool set_algo = false, set_size = false, set_work_size = false;
+
+    g_conflict_map_size = 256 * (1<<20);
     int argn = 1;
     while (argn < argc)
     {
@@ -1407,6 +3005,7 @@ int main(int argc, _TCHAR* argv[])
             if(++argn==argc)
                 Usage();
             g_conflict_map_size = atoi(argv[argn]) << 20;
+            set_size = true;
             argn++;
         }
         else if (strcmp(argv[argn], "-a") == 0)
@@ -1426,21 +3025,28 @@ int main(int argc, _TCHAR* argv[])
                 break;
             }
 
+            set_algo = g_algo != AUTO;
             printf("Option algo selected: %s\n", gpu_algo_names[g_algo]);
             argn += 2;
             //sortAscending = false;
         }
         else if (strcmp(argv[argn], "-d") == 0)
         {
-            g_device_num = atoi(argv[argn+1]);
-            printf("Option device selected: %d\n", g_device_num);
+            if(argn + 1 == argc || !ParseDeviceList(argv[argn+1]))
+                Usage();
+            printf("Option device selected: %s\n", argv[argn+1]);
             argn += 2;
             //sortAscending = false;
         }
         else if (strcmp(argv[argn], "-p") == 0)
         {
-            g_platform_num = atoi(argv[argn+1]);
-            printf("Option platform  selected: %d\n", g_platform_num);
+            if(argn + 1 == argc)
+                Usage();
+            char *end;
+            g_platform_num = strtoul(argv[argn+1], &end, 10);
+            if(end == argv[argn+1] || *end != 0)
+                g_platform_name = argv[argn+1];
+            printf("Option platform  selected: %s\n", argv[argn+1]);
             argn += 2;
             //sortAscending = false;
         }
@@ -1462,8 +3068,85 @@ int main(int argc, _TCHAR* argv[])
         }else if (strcmp(argv[argn], "-W") == 0)
         {
             g_work_size = atoi(argv[argn+1]);
+            set_work_size = true;
             printf("Option worksize: %d\n", g_work_size);
             argn += 2;
+        }else if (strcmp(argv[argn], "-m") == 0)
+        {
+            if(++argn==argc)
+                Usage();
+            if(strcmp(argv[argn], "bitmap") == 0)
+                g_gpu_mode = MODE_BITMAP;
+            else if(strcmp(argv[argn], "table") == 0)
+                g_gpu_mode = MODE_TABLE;
+            else
+                Usage();
+            printf("Option gpu mode: %s\n", gpu_mode_names[g_gpu_mode]);
+            argn++;
+        }else if (strcmp(argv[argn], "-c") == 0)
+        {
+            g_cpu_mode = true;
+            g_cpu_threads = atoi(argv[argn+1]);
+            printf("Option cpu threads: %d\n", g_cpu_threads);
+            argn += 2;
+        }else if (strcmp(argv[argn], "--cpu-batch") == 0)
+        {
+            if(argn + 1 == argc)
+                Usage();
+            g_cpu_batch = atoi(argv[argn+1]);
+            printf("Option cpu probe batch: %u\n", g_cpu_batch);
+            argn += 2;
+        }else if (strcmp(argv[argn], "--cpu-engine") == 0)
+        {
+            if(++argn==argc)
+                Usage();
+            if(strcmp(argv[argn], "partition") == 0)
+                g_cpu_engine = CPU_ENGINE_PARTITION;
+            else if(strcmp(argv[argn], "sort") == 0)
+                g_cpu_engine = CPU_ENGINE_SORT;
+            else if(strcmp(argv[argn], "table") == 0)
+                g_cpu_engine = CPU_ENGINE_TABLE;
+            else
+                Usage();
+            printf("Option cpu engine: %s\n", cpu_engine_names[g_cpu_engine]);
+            argn++;
+        }else if (strcmp(argv[argn], "--mem-budget") == 0)
+        {
+            if(argn + 1 == argc)
+                Usage();
+            g_mem_budget = atoi(argv[argn+1]) << 20;
+            printf("Option memory budget: %u MB\n", g_mem_budget>>20);
+            argn += 2;
+        }else if (strcmp(argv[argn], "--autotune") == 0)
+        {
+            autotune = true;
+            argn++;
+        }else if (strcmp(argv[argn], "--device-type") == 0)
+        {
+            if(argn + 1 == argc || !ParseDeviceType(argv[argn+1]))
+                Usage();
+            printf("Option device type: %s\n", device_type_names[g_device_type]);
+            argn += 2;
+        }else if (strcmp(argv[argn], "--device-name") == 0)
+        {
+            if(argn + 1 == argc)
+                Usage();
+            g_device_name = argv[argn+1];
+            printf("Option device name: %s\n", g_device_name);
+            argn += 2;
+        }else if (strcmp(argv[argn], "--sub-devices") == 0)
+        {
+            if(argn + 1 == argc)
+                Usage();
+            g_sub_devices = atoi(argv[argn+1]);
+            if(g_sub_devices < 2 || g_sub_devices > SUB_DEVICES_MAX)
+                Usage();
+            printf("Option sub-devices: %u\n", g_sub_devices);
+            argn += 2;
+        }else if (strcmp(argv[argn], "--list-devices") == 0)
+        {
+            list_devices = true;    //after --sub-devices wherever that is given
+            argn++;
         }
         else
         {
@@ -1471,89 +3154,155 @@ int main(int argc, _TCHAR* argv[])
         }
     }
 
+    if(list_devices){
+        ListDevices();
+        exit(0);
+    }
+
     if( argc < 2 )
     {
         printf("No command line arguments specified, using default values.\n");
     }
 
-    g_group_size = 8;
-
     g_test_arraySize = arraySize;
-    //jim test sha512 opencl
-    printf("Initializing OpenCL runtime...\n");
 
-    //initialize Open CL objects (context, queue, etc.)
-    if( 0 != Setup_OpenCL("momentum_miner.cl", &dev_alignment, g_conflict_map_size,
-                           g_algo, g_platform_num, g_device_num, 1) )
-        return -1;
+    if(g_cpu_mode){
+        printf("Initializing CPU search engine...\n");
+        if(cpu_miner_init(g_cpu_threads, g_conflict_map_size, g_cpu_batch, g_cpu_engine,
+                          g_mem_budget))
+            return -1;
 
-    //random input
-    unsigned char block[80];
-    unsigned char midhash[32];
-    memset(block, 0, 80);
+        //random input
+        unsigned char midhash[32];
+        double totalConuterTime = 0;
+        unsigned int collisions = 0;
+        perf_clock::time_point turn_start, turn_stop;
 
-    g_work_num = 1;
-    unsigned int  test_num = g_work_num;
-    double totalConuterTime = 0;
+        for(unsigned int i = 1; i < 1 + g_run_turns; i++){
+            test_midhash(i, midhash);
+            g_work_num = i;
+            printf("test new mid hash[%d]: %02x%02x %02x%02x ...  %02x%02x  %02x%02x\n",
+                   i, midhash[0], midhash[1], midhash[2], midhash[3],
+                   midhash[28], midhash[29], midhash[30], midhash[31]);
 
-    if(initGPUBuffer(g_conflict_map_size)){
-        clean(1);
-    }
+            turn_start = perf_clock::now();
 
-    for(unsigned int i=test_num; i<test_num + g_run_turns; i++){
-        block[0] = i;
-        sha256_ctx c256;
-        sha256_init(&c256);
-        sha256_update(&c256, (unsigned char*)block, 80);
-        sha256_final(&c256, midhash);
-        sha256_init(&c256);
-        sha256_update(&c256, (unsigned char*)midhash, 32);
-        sha256_final(&c256, midhash);
+            unsigned int match_nonce[2*MAX_FOUND_IN_TURN];
+            unsigned int match_num = 0;
 
-        g_work_num = i;
-        printf("test new mid hash: %02x%02x ...\n", midhash[0], midhash[1]);
-        g_work_started = 1;
-        while(!g_work_finished)Sleep(1);
-         g_work_finished = 0;
-         g_work_started = 0;
+            int ret = match_birthday_cpu_alg(i, g_conflict_map_size, midhash, match_nonce, &match_num);
+            if(ret){
+                printf("[Error]Failed to execute cpu search: %d\n", ret);
+                exit(ret);
+            }
 
-         printf("test new mid hash[%d]: %02x%02x %02x%02x ...  %02x%02x  %02x%02x\n",
-           i, midhash[0], midhash[1], midhash[2], midhash[3],
-              midhash[28], midhash[29], midhash[30], midhash[31]);
+            uint64 tem;
+            for(unsigned int k = 0; k < match_num; k += 2){
+                if(conflict_validate(NULL, midhash, match_nonce[k], match_nonce[k + 1], &tem)){
+                    collisions += 2;
+                    printf("Found conflict [%d]: %u(0x%08x) <-> %u(0x%08x) bir:%llx\n", match_num/2,
+                           match_nonce[k], match_nonce[k],
+                           match_nonce[k + 1], match_nonce[k + 1], tem);
+                }
+            }
+            if(g_dbg_flag)
+                printf("Return conflicts: %d\n", match_num);
 
+            turn_stop = perf_clock::now();
 
-    QueryPerformanceCounter(&g_PerfTotalStart);
+            float this_turn_counter = (float)perf_ms(turn_start, turn_stop);
 
-    unsigned int match_nonce[2*MAX_FOUND_IN_TURN];
-    unsigned int match_num = 0;
+            totalConuterTime += this_turn_counter;
+
+            if(i%g_stat_every_turns==0){
+                printf("[Perf]<---Work %u end. [conflicts:%u, meter:%.2f conflicts/min, runing:%.2f h].\n", i,
+                       collisions, collisions*60000.0/totalConuterTime,
+                       totalConuterTime/3600000.0f);
+            }
+        }
+        clean(0);
+    }
+
+    if(g_platform_name != NULL){
+        int p = FindOCLPlatform(g_platform_name);
+        if(p < 0){
+            printf("Error: No platform named like '%s', see --list-devices.\n", g_platform_name);
+            return -1;
+        }
+        g_platform_num = p;
+    }
 
-    int ret = match_birthday_gpu_alg(i, g_conflict_map_size, midhash, match_nonce, &match_num);
-    if(ret){
-      printf("[Error]Failed to execute gpu kernel: %d\n", ret);
-      exit(ret);
+    if(SelectDevices(g_platform_num) == 0){
+        printf("Error: No %s device%s%s found on platform %d.\n",
+               device_type_names[g_device_type], g_device_name ? " named like " : "",
+               g_device_name ? g_device_name : "", g_platform_num);
+        return -1;
     }
-    if(g_dbg_flag)
-      printf("Return conflicts: %d\n", match_num);
 
-    QueryPerformanceCounter(&g_PerfTotalStop);
-    QueryPerformanceFrequency(&g_PerfFrequency);
+    for(unsigned int i = 0; i < g_device_count; i++){
+        MinerContext *ctx = miner_context_create(g_platform_num, g_device_type, g_dev_nums[i],
+                                                 g_algo, g_gpu_mode, g_conflict_map_size,
+                                                 g_work_size);
+        if(ctx == NULL)
+            clean(1);
+        miner_context_set_mem_budget(ctx, g_mem_budget);
+        g_contexts[g_context_count++] = ctx;
 
-    float this_turn_counter = 1000.0f*
-        (float)((g_PerfTotalStop.QuadPart - g_PerfTotalStart.QuadPart)
-                /(float)g_PerfFrequency.QuadPart);
+        if(autotune){
+            if(gpu_autotune(ctx))
+                clean(1);
+            continue;
+        }
+        ApplyTuning(ctx, set_algo, set_size, set_work_size);
 
-    totalConuterTime += this_turn_counter;
+        printf("Initializing OpenCL runtime for device %u...\n", ctx->dev_num);
 
-    if(i%g_stat_every_turns==0){
-        printf("[Perf]<---Work %u end. [conflicts:%u, meter:%.2f conflicts/min, runing:%.2f h].\n", i,
-           totalCollisionCount, totalCollisionCount*60000.0/totalConuterTime,
-           totalConuterTime/3600000.0f);
+        //initialize Open CL objects (context, queue, etc.) and the buffers
+        int err = miner_context_init(ctx, "momentum_miner.cl");
+        if(err)
+            clean(err);
     }
+    if(autotune)
+        clean(0);
 
+    g_work_num = 1;
+    g_next_work = g_work_num;
+    g_last_work = g_work_num + g_run_turns;
+    g_run_start = perf_clock::now();
+
+    std::thread workers[MAX_GPU_NUM];
+    int results[MAX_GPU_NUM];
+    for(unsigned int i = 0; i < g_context_count; i++)
+        workers[i] = std::thread(gpu_device_worker, g_contexts[i], &results[i]);
+
+    int ret = 0;
+    for(unsigned int i = 0; i < g_context_count; i++){
+        workers[i].join();
+        if(results[i])
+            ret = results[i];
+    }
+
+    unsigned int total = 0;
+    for(unsigned int i = 0; i < g_context_count; i++){
+        miner_stats stats;
+        miner_context_stats(g_contexts[i], &stats);
+        total += stats.collisions;
+        printf("[Perf] Device %u: %u turns, conflicts:%u, meter:%.2f conflicts/min.\n",
+               g_contexts[i]->dev_num, stats.turns, stats.collisions,
+               stats.busy_ms > 0 ? stats.collisions*60000.0/stats.busy_ms : 0.0);
+        if(stats.match_overflow || stats.result_overflow){
+            printf("[Perf] Device %u overflowed: %u phase 1 pairs, %u collisions dropped.\n",
+                   g_contexts[i]->dev_num, stats.match_overflow, stats.result_overflow);
+        }
+    }
+    if(g_context_count > 1){
+        perf_clock::time_point now = perf_clock::now();
+        double wall_ms = perf_ms(g_run_start, now);
+        printf("[Perf] All %u devices: conflicts:%u, meter:%.2f conflicts/min.\n",
+               g_context_count, total, total*60000.0/wall_ms);
+    }
 
-   }
-
-    clean(0);
-    return 0;
+    clean(ret);
+    return ret;
 }
 #endif
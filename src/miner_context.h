@@ -0,0 +1,104 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef MINER_CONTEXT_H
+#define MINER_CONTEXT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gpu_algos {
+    AUTO,
+    GEEKJ,      /* GCN*/
+    KISS,       /* CLASSIC*/
+    GEN,
+};
+
+enum gpu_modes {
+    MODE_TABLE,     /* 32 bits per slot look up table, birthdayPhase1 */
+    MODE_BITMAP,    /* 1 bit per birthday filter cascade, phase 1..6 */
+};
+
+/* OpenCL device types a context may open; dev_num counts within the type. */
+enum device_types {
+    DEVICE_GPU,
+    DEVICE_CPU,
+    DEVICE_ACCELERATOR,
+    DEVICE_ALL,
+};
+
+/*
+ * One OpenCL device with its kernels, buffers, knobs and counters. Every
+ * search function takes the context it works on, so several contexts can
+ * run from different threads of one process. A context is used by one
+ * thread at a time; only miner_context_stats() may be called from others.
+ */
+typedef struct MinerContext MinerContext;
+
+typedef struct {
+    unsigned int collisions;        /* validated nonces, 2 per pair */
+    unsigned int match_overflow;    /* table candidates past MATCH_ARRAY_SIZE */
+    unsigned int result_overflow;   /* collisions past the result buffer, which then grows */
+    unsigned int turns;
+    double busy_ms;                 /* time spent in turns */
+} miner_stats;
+
+/*
+ * Knobs are only stored here and may still be changed by the tuning until
+ * miner_context_init() builds the kernels and allocates map_size bytes.
+ */
+MinerContext *miner_context_create(unsigned int platform_num,
+                                   enum device_types dev_type, unsigned int dev_num,
+                                   enum gpu_algos algo, enum gpu_modes mode,
+                                   unsigned int map_size, unsigned int work_size);
+int  miner_context_init(MinerContext *ctx, const char *program_source);
+
+/*
+ * Table mode: cap the table at mem_budget bytes (0 = the device limit).
+ * A larger map_size is searched in passes over a table that much smaller,
+ * with the same expected yield for more hashing. The pairs differ from a
+ * single pass: each pass indexes other birthday bits and drops other
+ * birthdays on full slots. Set before miner_context_init().
+ */
+void miner_context_set_mem_budget(MinerContext *ctx, unsigned int mem_budget);
+void miner_context_destroy(MinerContext *ctx);
+
+void miner_context_stats(const MinerContext *ctx, miner_stats *stats);
+
+/*
+ * Table mode: queue a turn, then collect it in submit order, at most two
+ * outstanding. match_birthday_gpu_alg() does both for a single turn.
+ * *nonce_array points at every pair found, in a buffer the context owns
+ * and reuses on its next turn; *found_num counts nonces (2 per pair).
+ */
+int gpu_turn_submit(MinerContext *ctx, unsigned int work_num,
+                    int map_size, const unsigned char* midhash);
+int gpu_turn_collect(MinerContext *ctx, unsigned int work_num,
+                     const unsigned int **nonce_array, unsigned int *found_num);
+int match_birthday_gpu_alg(MinerContext *ctx, unsigned int work_num,
+                           int map_size, const unsigned char* midhash,
+                           const unsigned int **nonce_array, unsigned int *found_num);
+
+/* Bitmap mode, one blocking turn. */
+int match_birthday_bitmap_alg(MinerContext *ctx, unsigned int work_num,
+                              int map_size, const unsigned char* midhash,
+                              const unsigned int **nonce_array, unsigned int *found_num);
+
+/* Sweep the knobs on the context's device and save the best to the tune file. */
+int gpu_autotune(MinerContext *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MINER_CONTEXT_H */
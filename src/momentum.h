@@ -0,0 +1,23 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef MOMENTUM_H
+#define MOMENTUM_H
+
+/* Momentum POW shape, shared by the OpenCL host code and the CPU engine. */
+#define NONCE_BITS              26
+#define SEARCH_SPACE_BITS       50
+#define BIRTHDAYS_PER_HASH      8
+
+#define MAX_FOUND_IN_TURN       128
+
+#endif /* !MOMENTUM_H */
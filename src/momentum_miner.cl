@@ -256,6 +256,126 @@ uint64_t midHash[4]; //uint256_t
 };
 */
 
+/*
+Birthday hash from host precomputed constants, see sha512_birthday_init()
+in sha512_mb.cpp. The constant buffer holds sha512_birthday_ctx: the block
+words, the nonce independent part of every schedule word, k[i]+w[i] for the
+words without nonce and the state after round 0. Only the nonce half of
+w[0] (x) is per work item, so we start at round 1 and rebuild just the
+nonce dependent terms of w[16..37].
+*/
+#define BDAY_WC     16
+#define BDAY_KW     96
+#define BDAY_ST     176
+
+/*
+One hash per lane of bday_vec, ulong2 by default. Setup_OpenCL() passes a
+wider BDAY_VEC_WIDTH when the device prefers wider long vectors, as CPU
+runtimes do for AVX2 (4) and AVX-512 (8).
+*/
+#ifndef BDAY_VEC_WIDTH
+#define BDAY_VEC_WIDTH  2
+#endif
+#define _BDAY_VEC(n)    ulong##n
+#define BDAY_VEC(n)     _BDAY_VEC(n)
+#define bday_vec        BDAY_VEC(BDAY_VEC_WIDTH)
+
+#if BDAY_VEC_WIDTH == 8
+#define BDAY_LANES      ((bday_vec)(0, 1, 2, 3, 4, 5, 6, 7))
+#elif BDAY_VEC_WIDTH == 4
+#define BDAY_LANES      ((bday_vec)(0, 1, 2, 3))
+#else
+#define BDAY_LANES      ((bday_vec)(0, 1))
+#endif
+
+//lane l of a private vector, l must unroll to a constant
+#define BDAY_LANE(v, l) (((uint64_t *)&(v))[l])
+
+#define BDAY_ROUND(kw) {                    \
+        t1 = (kw) + h + Sigma1(e) + Ch(e, f, g); \
+        t2 = Maj(a, b, c) + Sigma0(a);      \
+        h = g;                              \
+        g = f;                              \
+        f = e;                              \
+        e = d + t1;                         \
+        d = c;                              \
+        c = b;                              \
+        b = a;                              \
+        a = t1 + t2;                        \
+    }
+
+#ifdef AMD_OPTIM
+inline 
+#endif
+void sha512_birthday_vec(constant uint64_t *_c, bday_vec x, bday_vec *w) {
+    constant uint64_t *wc = _c + BDAY_WC;
+    constant uint64_t *kw = _c + BDAY_KW;
+    bday_vec a = _c[BDAY_ST + 0] + x;
+    bday_vec b = _c[BDAY_ST + 1];
+    bday_vec c = _c[BDAY_ST + 2];
+    bday_vec d = _c[BDAY_ST + 3];
+    bday_vec e = _c[BDAY_ST + 4] + x;
+    bday_vec f = _c[BDAY_ST + 5];
+    bday_vec g = _c[BDAY_ST + 6];
+    bday_vec h = _c[BDAY_ST + 7];
+    bday_vec t1, t2;
+
+    #pragma unroll
+    for (int i = 1; i < 16; i++) {
+        BDAY_ROUND(kw[i]);
+    }
+
+    //w[i & 15] holds w16..w37, odd words below 22 are in kw already
+    w[0] = wc[16] + x;
+    BDAY_ROUND(kw[16] + w[0]);
+    BDAY_ROUND(kw[17]);
+    w[2] = wc[18] + sigma1(w[0]);
+    BDAY_ROUND(kw[18] + w[2]);
+    BDAY_ROUND(kw[19]);
+    w[4] = wc[20] + sigma1(w[2]);
+    BDAY_ROUND(kw[20] + w[4]);
+    BDAY_ROUND(kw[21]);
+    w[6] = wc[22] + sigma1(w[4]);
+    w[7] = wc[23] + w[0];
+    w[8] = wc[24] + sigma1(w[6]);
+    w[9] = wc[25] + sigma1(w[7]) + w[2];
+    w[10] = wc[26] + sigma1(w[8]);
+    w[11] = wc[27] + sigma1(w[9]) + w[4];
+    w[12] = wc[28] + sigma1(w[10]);
+    w[13] = wc[29] + sigma1(w[11]) + w[6];
+    w[14] = wc[30] + sigma1(w[12]) + w[7];
+    w[15] = wc[31] + sigma1(w[13]) + w[8] + sigma0(w[0]);
+
+    #pragma unroll
+    for (int i = 22; i < 32; i++) {
+        BDAY_ROUND(kw[i] + w[i & 15]);
+    }
+
+    w[0] = wc[32] + sigma1(w[14]) + w[9] + w[0];
+    w[1] = wc[33] + sigma1(w[15]) + w[10] + sigma0(w[2]);
+    w[2] = wc[34] + sigma1(w[0]) + w[11] + w[2];
+    w[3] = wc[35] + sigma1(w[1]) + w[12] + sigma0(w[4]);
+    w[4] = wc[36] + sigma1(w[2]) + w[13] + w[4];
+    w[5] = wc[37] + sigma1(w[3]) + w[14] + sigma0(w[6]);
+
+    #pragma unroll
+    for (int i = 32; i < 80; i++) {
+        if (i > 37) {
+            w[i & 15] = sigma1(w[(i - 2) & 15]) + sigma0(w[(i - 15) & 15]) + w[(i - 16) & 15] + w[(i - 7) & 15];
+        }
+        BDAY_ROUND(kw[i] + w[i & 15]);
+    }
+
+	w[0] = SWAP(H[0]+a); //SWAP only for final result, not for block!
+    w[1] = SWAP(H[1]+b);
+    w[2] = SWAP(H[2]+c);
+    w[3] = SWAP(H[3]+d);
+    w[4] = SWAP(H[4]+e);
+    w[5] = SWAP(H[5]+f);
+    w[6] = SWAP(H[6]+g);
+    w[7] = SWAP(H[7]+h);
+}
+
 #define bswap32(x) ( ((x) << 24) | (((x) << 8) & 0x00ff0000) | (((x) >> 8) & 0x0000ff00) | ((x) >> 24) )
 
 //value is a 50 bit number
@@ -272,56 +392,201 @@ inline uint32_t _50BitRor(uint64_t value, uint32_t n) {
 Phase 1 computes all hashes and sets them in bit hash table.
 Expects the whole bitmap and the first dword of collisionList to be zero
 */
-#define S2(n) (ulong2)(as_ulong(as_uchar8(n.x).s76543210), as_ulong(as_uchar8(n.y).s76543210))
-kernel void birthdayPhase1(constant uint64_t *_w, global uint32_t *bitmap, global uint32_t *collisionList)
+
+/*
+Table slot: gen | birthday bits above the index (tag) | hash number (nonce/8).
+Slots from another turn or pass (gen) count as empty, so the host only
+clears the table when gen wraps. Gen and tag share 9 bits, the host passes
+SLOT_GEN_BITS 4 rather than 3 when a turn takes a gen per pass and the
+table is large enough for a 5 bit tag, see TABLE_PASS_GEN_MIN. A phase 1
+pair is written as (hash base nonce, nonce); birthdayVerify rehashes both,
+finds which birthday of the base hash matched and keeps the pair only if
+the full birthdays are equal.
+*/
+#ifndef SLOT_GEN_BITS
+#define SLOT_GEN_BITS   3
+#endif
+#define SLOT_HASH_BITS  23
+#define SLOT_TAG_BITS   (32 - SLOT_HASH_BITS - SLOT_GEN_BITS)
+#define SLOT_GEN_SHIFT  (SLOT_HASH_BITS + SLOT_TAG_BITS)
+#define SLOT_HASH_MASK  ((1u << SLOT_HASH_BITS) - 1)
+#define SLOT_TAG_MASK   ((1u << SLOT_TAG_BITS) - 1)
+
+/*
+collisionList: [0] pairs requested this turn, pair k at [2 + 2k], [3 + 2k].
+The counter keeps counting past MATCH_PAIRS so overflow shows, only the
+stores are dropped. Each work-group stages its pairs in local memory and
+reserves its range with one atomic_add; a full stage goes to the global
+counter directly.
+*/
+#define MATCH_PAIRS     ((MATCH_ARRAY_SIZE - 2) / 2)
+#define STAGE_PAIRS     256
+
+/*
+Multi-pass table: pass p only inserts birthdays whose top TABLE_PASS_BITS
+bits are p, so a table 1/2^TABLE_PASS_BITS the size fills as much per pass.
+*/
+#ifndef TABLE_PASS_BITS
+#define TABLE_PASS_BITS 0
+#endif
+
+inline void match_list_push(global uint32_t *collisionList, uint32_t base, uint32_t nonce)
 {
-	ulong2 w[16];
+	const uint32_t rx = atomic_inc(collisionList);
+	if(rx < MATCH_PAIRS){
+		collisionList[2 + 2*rx] = base;
+		collisionList[3 + 2*rx] = nonce;
+	}
+}
+
+inline void table_insert(global uint32_t *bitmap, global uint32_t *collisionList,
+                         local uint32_t *stage, local uint32_t *stage_num,
+                         uint64_t digest, uint32_t nonce, uint32_t gen, uint32_t pass)
+{
+	const uint64_t birthday = digest >> (64 - SEARCH_SPACE_BITS);
+#if TABLE_PASS_BITS
+	if((uint32_t)(birthday >> (SEARCH_SPACE_BITS - TABLE_PASS_BITS)) != pass)
+		return;
+#endif
+	const uint32_t index = (uint32_t)birthday & LOOK_UP_MASK;
+	const uint32_t tag = (uint32_t)(birthday >> LOOK_UP_BITS) & SLOT_TAG_MASK;
+	uint32_t hy = (gen << SLOT_GEN_SHIFT) | (tag << SLOT_HASH_BITS) | (nonce / BIRTHDAYS_PER_HASH);
+	uint32_t oy = bitmap[index];
+	if((oy >> SLOT_GEN_SHIFT) == gen){
+		bool cond = ((oy ^ hy) >> SLOT_HASH_BITS) == 0; //same tag
+	   	if(cond){
+		   	const uint32_t base = (oy & SLOT_HASH_MASK) * BIRTHDAYS_PER_HASH;
+		   	const uint32_t sx = atomic_inc(stage_num);
+		   	if(sx < STAGE_PAIRS){
+		   		stage[2*sx] = base;
+		   		stage[2*sx + 1] = nonce;
+		   	}
+		   	else{
+		   		match_list_push(collisionList, base, nonce);
+		   	}
+	   	}
+	}
+	else{
+	   bitmap[index] = hy;
+	}
+}
+
+kernel void birthdayPhase1(constant uint64_t *_w, global uint32_t *bitmap, global uint32_t *collisionList, uint32_t gen, uint32_t pass)
+{
+	local uint32_t stage[2*STAGE_PAIRS];
+	local uint32_t stage_num;
+	local uint32_t stage_base;
+	const uint32_t lid = get_local_id(0);
+
+	if(lid == 0)
+		stage_num = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	bday_vec w[16];
 	uint32_t _x = get_global_id(0);
-	uint32_t t = 0; //*id_offset ;
-	uint32_t ot = _x * 16; //hashes per call;
-	
-    #pragma unroll
-	for(int i = 0; i < 16; i++)
-		w[i] = _w[i];
+	uint32_t ot = _x * BDAY_VEC_WIDTH * BIRTHDAYS_PER_HASH; //hashes per call;
 
-    ulong2 tem;
-	tem = (2*_x + (ulong2){0, 1}) * BIRTHDAYS_PER_HASH;
+	bday_vec tem;
+	tem = (BDAY_VEC_WIDTH*_x + BDAY_LANES) * BIRTHDAYS_PER_HASH;
 
-	w[0] = _w[0]| S2(tem);
-	sha512_block2(w);
+	sha512_birthday_vec(_w, SWAP(tem), w);
 
 	#pragma unroll
-	for(int i = 0; i<BIRTHDAYS_PER_HASH; i++){
-		uint32_t hy = ((i + t + ot) << 6) | ((w[i].x>>32) & 0x3f);
-		uint32_t oy = bitmap[w[i].x  & LOOK_UP_MASK];
-		if(oy){
-			bool cond = ((oy & 0x3f) == (hy & 0x3f )) ;
-		   	if(cond){
-			   	int rx = collisionList[0]++;
-			   	collisionList[2*rx] = oy >> 6;
-			   	collisionList[2*rx + 1] = hy >> 6;
-		   	}
-		}
-		else{
-		   bitmap[w[i].x  & LOOK_UP_MASK] = hy;
+	for(int l = 0; l<BDAY_VEC_WIDTH; l++){
+		#pragma unroll
+		for(int i = 0; i<BIRTHDAYS_PER_HASH; i++){
+			table_insert(bitmap, collisionList, stage, &stage_num, BDAY_LANE(w[i], l),
+			             i + ot + l*BIRTHDAYS_PER_HASH, gen, pass);
 		}
+	}
 
+	barrier(CLK_LOCAL_MEM_FENCE);
+	const uint32_t n = MIN(stage_num, STAGE_PAIRS);
+	if(lid == 0 && n)
+		stage_base = atomic_add(collisionList, n);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint32_t k = lid; k < n; k += get_local_size(0)){
+		const uint32_t rx = stage_base + k;
+		if(rx < MATCH_PAIRS){
+			collisionList[2 + 2*rx] = stage[2*k];
+			collisionList[3 + 2*rx] = stage[2*k + 1];
+		}
 	}
+}
+
+/*
+Table mode phase 2: rehashes both sides of every phase 1 pair and keeps the
+ones whose full SEARCH_SPACE_BITS birthdays match, with the exact nonce of
+the first hash. result: [0] phase 1 pairs, [1] collisions, collision k at
+[2 + 2k], [3 + 2k]. Like collisionList, [1] counts past result_pairs.
+*/
+kernel void birthdayVerify(constant uint64_t *_w, global uint32_t *collisionList, global uint32_t *result, uint32_t result_pairs)
+{
+	const uint32_t k = get_global_id(0);
+	const uint32_t pairs = collisionList[0];
+	if(k == 0)
+		result[0] = pairs;
+	if(k >= MIN(pairs, MATCH_PAIRS))
+		return;
+
+	const uint32_t base = collisionList[2 + 2*k];
+	const uint32_t nonce = collisionList[3 + 2*k];
+
+	//two hashes whatever BDAY_VEC_WIDTH is: lane 0 of base, lane 1 of
+	//the hash holding nonce, from the padded block at the head of _w
+	ulong2 w[16];
+	#pragma unroll
+	for(int i = 1; i < 16; i++)
+		w[i] = _w[i];
+	w[0] = _w[0] + SWAP((ulong2)((ulong)base, (ulong)(nonce & ~(BIRTHDAYS_PER_HASH - 1))));
+	sha512_block2(w);
+
+	const uint64_t birthday = w[nonce % BIRTHDAYS_PER_HASH].s1 >> (64 - SEARCH_SPACE_BITS);
 
 	#pragma unroll
-	for(int i = 0; i<BIRTHDAYS_PER_HASH; i++){
-		uint32_t hy = ((i + t + ot + BIRTHDAYS_PER_HASH) << 6) | ((w[i].y>>32) & 0x3f);
-		uint32_t oy = bitmap[w[i].y  & LOOK_UP_MASK];
-		if(oy){
-			bool cond = ((oy & 0x3f) == (hy & 0x3f )) ;
-		   	if(cond){
-			   	int rx = collisionList[0]++;
-			   	collisionList[2*rx] = oy >> 6;
-			   	collisionList[2*rx + 1] = hy >> 6;
-		   	}
+	for(uint32_t i = 0; i < BIRTHDAYS_PER_HASH; i++){
+		if(base + i != nonce && (w[i].s0 >> (64 - SEARCH_SPACE_BITS)) == birthday){
+			const uint32_t rx = atomic_inc(&result[1]);
+			if(rx < result_pairs){
+				result[2 + 2*rx] = base + i;
+				result[3 + 2*rx] = nonce;
+			}
+			break;
 		}
-		else{
-		   bitmap[w[i].y  & LOOK_UP_MASK] = hy;
+	}
+}
+
+/*
+Bitmap pipeline phase 1: sets a bit per birthday, lists hashes with a bit already set.
+Expects the whole bitmap and the first dword of collisionList to be zero
+*/
+kernel void birthdayBitmapPhase1(constant uint64_t *_w, global uint32_t *bitmap, global uint32_t *collisionList)
+{
+	uint64_t w[16];
+	const uint32_t num = get_global_id(0);
+    #pragma unroll
+	for(int i = 0; i < 16; i++)
+		w[i] = _w[i];
+
+	((uint32_t*)w)[1] = bswap32(num*BIRTHDAYS_PER_HASH);
+
+	sha512_block(w);
+
+	uint32_t alreadyWritten = 0;
+	for(int i = 0; i < 8; i++) {
+		w[i] = w[i] >> (64 - SEARCH_SPACE_BITS);
+		const BITMAP_INDEX_TYPE bitIndex = BITMAP_INDEX_MASK(w[i]);
+		const uint32_t dwordIndex = bitIndex/32;
+		const uint32_t bitInDword = bitIndex%32;
+		const uint32_t mask = 1<<bitInDword;
+		const uint32_t last = atomic_or(&bitmap[dwordIndex], mask); //set bit for our hash
+
+		//don't move this out of the loop as this will cluster atomic_inc
+		if(last&mask && alreadyWritten == 0) { //we have a collision
+			alreadyWritten = 1; //don't write the same nonce several times
+			const uint32_t listIndex = atomic_inc(collisionList)+1;
+			collisionList[listIndex] = num*BIRTHDAYS_PER_HASH; //collisionList is going to have all nonces with collision
 		}
 	}
 }
@@ -439,8 +704,7 @@ kernel void birthdayPhase5(constant uint64_t *_w, global uint32_t *bitmap, globa
 	sha512_block(w);
 #ifdef AMD_OPTIM2
 	#pragma unroll
-	for(int i = 0; i < 8; i++) {
-#else
+#endif
 	for(int i = 0; i < 8; i++) {
 		const BITMAP_INDEX_TYPE bitIndex = BITMAP_INDEX_MASK(_50BitRor(w[i] >> (64 - SEARCH_SPACE_BITS), rotateN)); 
 		const uint32_t dwordIndex = bitIndex/32;
@@ -448,7 +712,6 @@ kernel void birthdayPhase5(constant uint64_t *_w, global uint32_t *bitmap, globa
 		const uint32_t mask = 1<<bitInDword;
 		atomic_or(&bitmap[dwordIndex], mask); //set bit for our hash
 	}
-#endif
 }
 
 /*
@@ -0,0 +1,108 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+/*
+ * Body of the precomputed birthday compression, included by sha512_mb.cpp
+ * once per lane width (no include guard on purpose). The includer defines:
+ *
+ *   BDAY_FUNC, BDAY_ATTR     function name and target attribute
+ *   BDAY_VEC                 one 64-bit word per lane
+ *   V_SET1(x) V_ADD(x, y)    broadcast, add
+ *   V_F1 .. V_F4, V_CH, V_MAJ  the SHA-512 functions
+ *   V_NONCE(nonce)           nonce half of w[0] for every lane
+ *   V_STORE(st, digest)      add h0, byte swap and transpose st[8] out
+ *
+ * Only the w[0] nonce term differs between lanes. Words 16..37 add just
+ * their nonce dependent terms to ctx->wc[], words 17, 19 and 21 and all
+ * of round 0 are folded into the context by sha512_birthday_init().
+ */
+
+#define BDAY_ROUND(kw)                                          \
+{                                                               \
+    t1 = V_ADD(V_ADD(h, V_F2(e)), V_ADD(V_CH(e, f, g), kw));    \
+    t2 = V_ADD(V_F1(a), V_MAJ(a, b, c));                        \
+    h = g;                                                      \
+    g = f;                                                      \
+    f = e;                                                      \
+    e = V_ADD(d, t1);                                           \
+    d = c;                                                      \
+    c = b;                                                      \
+    b = a;                                                      \
+    a = V_ADD(t1, t2);                                          \
+}
+
+#define BDAY_WC(j)  V_SET1(ctx->wc[j])
+#define BDAY_KW(j)  V_SET1(ctx->kw[j])
+
+BDAY_ATTR
+void BDAY_FUNC(const sha512_birthday_ctx *ctx, const uint32 *nonce,
+               uint64 *digest)
+{
+    BDAY_VEC w[80];
+    BDAY_VEC a, b, c, d, e, f, g, h, t1, t2;
+    BDAY_VEC x = V_NONCE(nonce);
+    int j;
+
+    w[16] = V_ADD(BDAY_WC(16), x);
+    w[18] = V_ADD(BDAY_WC(18), V_F4(w[16]));
+    w[20] = V_ADD(BDAY_WC(20), V_F4(w[18]));
+    w[22] = V_ADD(BDAY_WC(22), V_F4(w[20]));
+    w[23] = V_ADD(BDAY_WC(23), w[16]);
+    w[24] = V_ADD(BDAY_WC(24), V_F4(w[22]));
+    w[25] = V_ADD(BDAY_WC(25), V_ADD(V_F4(w[23]), w[18]));
+    w[26] = V_ADD(BDAY_WC(26), V_F4(w[24]));
+    w[27] = V_ADD(BDAY_WC(27), V_ADD(V_F4(w[25]), w[20]));
+    w[28] = V_ADD(BDAY_WC(28), V_F4(w[26]));
+    w[29] = V_ADD(BDAY_WC(29), V_ADD(V_F4(w[27]), w[22]));
+    w[30] = V_ADD(BDAY_WC(30), V_ADD(V_F4(w[28]), w[23]));
+    w[31] = V_ADD(V_ADD(BDAY_WC(31), V_F4(w[29])), V_ADD(w[24], V_F3(w[16])));
+    w[32] = V_ADD(V_ADD(BDAY_WC(32), V_F4(w[30])), V_ADD(w[25], w[16]));
+    w[33] = V_ADD(V_ADD(BDAY_WC(33), V_F4(w[31])), V_ADD(w[26], V_F3(w[18])));
+    w[34] = V_ADD(V_ADD(BDAY_WC(34), V_F4(w[32])), V_ADD(w[27], w[18]));
+    w[35] = V_ADD(V_ADD(BDAY_WC(35), V_F4(w[33])), V_ADD(w[28], V_F3(w[20])));
+    w[36] = V_ADD(V_ADD(BDAY_WC(36), V_F4(w[34])), V_ADD(w[29], w[20]));
+    w[37] = V_ADD(V_ADD(BDAY_WC(37), V_F4(w[35])), V_ADD(w[30], V_F3(w[22])));
+    for (j = 38; j < 80; j++) {
+        w[j] = V_ADD(V_ADD(V_F4(w[j - 2]), w[j - 7]),
+                     V_ADD(V_F3(w[j - 15]), w[j - 16]));
+    }
+
+    a = V_ADD(V_SET1(ctx->st[0]), x);
+    b = V_SET1(ctx->st[1]);
+    c = V_SET1(ctx->st[2]);
+    d = V_SET1(ctx->st[3]);
+    e = V_ADD(V_SET1(ctx->st[4]), x);
+    f = V_SET1(ctx->st[5]);
+    g = V_SET1(ctx->st[6]);
+    h = V_SET1(ctx->st[7]);
+
+    for (j = 1; j < 16; j++) {
+        BDAY_ROUND(BDAY_KW(j));
+    }
+    for (j = 16; j < 22; j++) {
+        if (j & 1) {
+            BDAY_ROUND(BDAY_KW(j));
+        } else {
+            BDAY_ROUND(V_ADD(BDAY_KW(j), w[j]));
+        }
+    }
+    for (j = 22; j < 80; j++) {
+        BDAY_ROUND(V_ADD(BDAY_KW(j), w[j]));
+    }
+
+    BDAY_VEC st[8] = {a, b, c, d, e, f, g, h};
+    V_STORE(st, digest);
+}
+
+#undef BDAY_ROUND
+#undef BDAY_WC
+#undef BDAY_KW
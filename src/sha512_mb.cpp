@@ -0,0 +1,334 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include <string.h>
+
+#include "sha512_mb.h"
+
+extern uint64 sha512_h0[8];
+extern uint64 sha512_k[80];
+
+#define S_ROTR(x, n)    (((x) >> (n)) | ((x) << (64 - (n))))
+#define S_F1(x) (S_ROTR(x, 28) ^ S_ROTR(x, 34) ^ S_ROTR(x, 39))
+#define S_F2(x) (S_ROTR(x, 14) ^ S_ROTR(x, 18) ^ S_ROTR(x, 41))
+#define S_F3(x) (S_ROTR(x,  1) ^ S_ROTR(x,  8) ^ ((x) >> 7))
+#define S_F4(x) (S_ROTR(x, 19) ^ S_ROTR(x, 61) ^ ((x) >> 6))
+#define S_CH(x, y, z)   (((x) & (y)) ^ (~(x) & (z)))
+#define S_MAJ(x, y, z)  (((x) & (y)) | (((x) | (y)) & (z)))
+
+#define BSWAP32(x)  ((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) | \
+                     (((x) >> 8) & 0xff00) | ((x) >> 24))
+
+static inline uint64 bswap64(uint64 x)
+{
+    return ((uint64)BSWAP32((uint32)x) << 32) | BSWAP32((uint32)(x >> 32));
+}
+
+void sha512_birthday_init(sha512_birthday_ctx *ctx,
+                          const unsigned char *midhash)
+{
+    unsigned char block[SHA512_BLOCK_SIZE];
+    bool dep[80];
+    uint64 t1, t2;
+    int i, j;
+
+    /* nonce bytes stay zero, the nonce is added back per call */
+    memset(block, 0, sizeof(block));
+    memcpy(block + 4, midhash, 32);
+    block[SHA512_MB_MSG_SIZE] = 0x80;
+    block[SHA512_BLOCK_SIZE - 2] = (SHA512_MB_MSG_SIZE * 8) >> 8;
+    block[SHA512_BLOCK_SIZE - 1] = (SHA512_MB_MSG_SIZE * 8) & 0xff;
+
+    for (j = 0; j < 16; j++) {
+        ctx->w[j] = 0;
+        for (i = 0; i < 8; i++) {
+            ctx->w[j] = (ctx->w[j] << 8) | block[(j << 3) + i];
+        }
+        ctx->wc[j] = ctx->w[j];
+        dep[j] = (j == 0);
+    }
+
+    /* constant part of each schedule word, see sha512_bday_body.h */
+    for (j = 16; j < 80; j++) {
+        uint64 terms[4] = { S_F4(ctx->wc[j - 2]), ctx->wc[j - 7],
+                            S_F3(ctx->wc[j - 15]), ctx->wc[j - 16] };
+        bool tdep[4] = { dep[j - 2], dep[j - 7], dep[j - 15], dep[j - 16] };
+
+        dep[j] = tdep[0] || tdep[1] || tdep[2] || tdep[3];
+        ctx->wc[j] = 0;
+        for (i = 0; i < 4; i++) {
+            /* w[0] only lacks the nonce, its constant half goes into wc */
+            if (!tdep[i] || j == 16)
+                ctx->wc[j] += terms[i];
+        }
+    }
+
+    for (j = 0; j < 80; j++) {
+        ctx->kw[j] = sha512_k[j] + (dep[j] ? 0 : ctx->wc[j]);
+    }
+
+    t1 = sha512_h0[7] + S_F2(sha512_h0[4])
+       + S_CH(sha512_h0[4], sha512_h0[5], sha512_h0[6])
+       + sha512_k[0] + ctx->w[0];
+    t2 = S_F1(sha512_h0[0]) + S_MAJ(sha512_h0[0], sha512_h0[1], sha512_h0[2]);
+    ctx->st[0] = t1 + t2;
+    ctx->st[1] = sha512_h0[0];
+    ctx->st[2] = sha512_h0[1];
+    ctx->st[3] = sha512_h0[2];
+    ctx->st[4] = sha512_h0[3] + t1;
+    ctx->st[5] = sha512_h0[4];
+    ctx->st[6] = sha512_h0[5];
+    ctx->st[7] = sha512_h0[6];
+}
+
+/* scalar: one lane */
+
+#define BDAY_FUNC   sha512_birthday
+#define BDAY_ATTR
+#define BDAY_VEC    uint64
+#define V_SET1(x)   (x)
+#define V_ADD(x, y) ((x) + (y))
+#define V_F1        S_F1
+#define V_F2        S_F2
+#define V_F3        S_F3
+#define V_F4        S_F4
+#define V_CH        S_CH
+#define V_MAJ       S_MAJ
+#define V_NONCE(n)  ((uint64)BSWAP32((n)[0]) << 32)
+#define V_STORE(st, digest)                                 \
+{                                                           \
+    for (j = 0; j < 8; j++)                                 \
+        (digest)[j] = bswap64((st)[j] + sha512_h0[j]);      \
+}
+#include "sha512_bday_body.h"
+#undef BDAY_FUNC
+#undef BDAY_ATTR
+#undef BDAY_VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_F1
+#undef V_F2
+#undef V_F3
+#undef V_F4
+#undef V_CH
+#undef V_MAJ
+#undef V_NONCE
+#undef V_STORE
+
+#ifndef SHA512_MB_X86
+
+sha512_birthday_func sha512_birthday_select(unsigned int *lanes)
+{
+    *lanes = 1;
+    return sha512_birthday;
+}
+
+#else
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* XCR0 bits the OS must have enabled before ymm/zmm state is usable */
+#define XCR0_AVX_STATE      0x06    /* xmm, ymm */
+#define XCR0_AVX512_STATE   0xe6    /* xmm, ymm, opmask, zmm hi256, hi16 zmm */
+
+static unsigned int sha512_mb_xcr0(void)
+{
+    unsigned int eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+}
+
+/* widest lane count usable on this CPU and OS */
+static unsigned int sha512_mb_detect(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int xcr0 = 0;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 1;
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return 1;
+
+    xcr0 = sha512_mb_xcr0();
+    if ((xcr0 & XCR0_AVX_STATE) != XCR0_AVX_STATE)
+        return 1;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 1;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    if ((ebx & bit_AVX512F) && (xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE)
+        return 8;
+    if (ebx & bit_AVX2)
+        return 4;
+    return 1;
+}
+
+sha512_birthday_func sha512_birthday_select(unsigned int *lanes)
+{
+    *lanes = sha512_mb_detect();
+    switch (*lanes) {
+    case 8:
+        return sha512_birthday_x8_avx512;
+    case 4:
+        return sha512_birthday_x4_avx2;
+    default:
+        return sha512_birthday;
+    }
+}
+
+/* AVX2: four 64-bit lanes, rotates built from shifts */
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+#define V4_ROTR(x, n)   _mm256_or_si256(_mm256_srli_epi64(x, n), \
+                                        _mm256_slli_epi64(x, 64 - (n)))
+#define V4_SHFR(x, n)   _mm256_srli_epi64(x, n)
+#define V4_ADD(x, y)    _mm256_add_epi64(x, y)
+#define V4_XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+
+#define V4_F1(x) V4_XOR3(V4_ROTR(x, 28), V4_ROTR(x, 34), V4_ROTR(x, 39))
+#define V4_F2(x) V4_XOR3(V4_ROTR(x, 14), V4_ROTR(x, 18), V4_ROTR(x, 41))
+#define V4_F3(x) V4_XOR3(V4_ROTR(x,  1), V4_ROTR(x,  8), V4_SHFR(x,  7))
+#define V4_F4(x) V4_XOR3(V4_ROTR(x, 19), V4_ROTR(x, 61), V4_SHFR(x,  6))
+
+#define V4_CH(x, y, z)  _mm256_xor_si256(_mm256_and_si256(x, y), \
+                                         _mm256_andnot_si256(x, z))
+#define V4_MAJ(x, y, z) _mm256_or_si256(_mm256_and_si256(x, y), \
+                                        _mm256_and_si256(_mm256_or_si256(x, y), z))
+
+#define BDAY_FUNC   sha512_birthday_x4_avx2
+#define BDAY_ATTR   AVX2_TARGET
+#define BDAY_VEC    __m256i
+#define V_SET1(x)   _mm256_set1_epi64x(x)
+#define V_ADD       V4_ADD
+#define V_F1        V4_F1
+#define V_F2        V4_F2
+#define V_F3        V4_F3
+#define V_F4        V4_F4
+#define V_CH        V4_CH
+#define V_MAJ       V4_MAJ
+#define V_NONCE(n)  _mm256_slli_epi64(_mm256_set_epi64x(                     \
+                        BSWAP32((n)[3]), BSWAP32((n)[2]),                   \
+                        BSWAP32((n)[1]), BSWAP32((n)[0])), 32)
+#define V_STORE(st, digest)                                                 \
+{                                                                           \
+    const __m256i swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,           \
+                                          15, 14, 13, 12, 11, 10, 9, 8,     \
+                                          7, 6, 5, 4, 3, 2, 1, 0,           \
+                                          15, 14, 13, 12, 11, 10, 9, 8);    \
+    uint64 out[8][4] __attribute__((aligned(32)));                          \
+    int i;                                                                  \
+    for (j = 0; j < 8; j++) {                                               \
+        _mm256_store_si256((__m256i *)out[j], _mm256_shuffle_epi8(          \
+            V4_ADD((st)[j], _mm256_set1_epi64x(sha512_h0[j])), swap));      \
+    }                                                                       \
+    for (i = 0; i < 4; i++)                                                 \
+        for (j = 0; j < 8; j++)                                             \
+            (digest)[i * 8 + j] = out[j][i];                                \
+}
+#include "sha512_bday_body.h"
+#undef BDAY_FUNC
+#undef BDAY_ATTR
+#undef BDAY_VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_F1
+#undef V_F2
+#undef V_F3
+#undef V_F4
+#undef V_CH
+#undef V_MAJ
+#undef V_NONCE
+#undef V_STORE
+
+/* AVX-512F: eight 64-bit lanes, native rotates and ternary logic */
+
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+#define V8_ROTR(x, n)   _mm512_ror_epi64(x, n)
+#define V8_SHFR(x, n)   _mm512_srli_epi64(x, n)
+#define V8_ADD(x, y)    _mm512_add_epi64(x, y)
+#define V8_XOR3(x, y, z) _mm512_ternarylogic_epi64(x, y, z, 0x96)
+
+#define V8_F1(x) V8_XOR3(V8_ROTR(x, 28), V8_ROTR(x, 34), V8_ROTR(x, 39))
+#define V8_F2(x) V8_XOR3(V8_ROTR(x, 14), V8_ROTR(x, 18), V8_ROTR(x, 41))
+#define V8_F3(x) V8_XOR3(V8_ROTR(x,  1), V8_ROTR(x,  8), V8_SHFR(x,  7))
+#define V8_F4(x) V8_XOR3(V8_ROTR(x, 19), V8_ROTR(x, 61), V8_SHFR(x,  6))
+
+#define V8_CH(x, y, z)  _mm512_ternarylogic_epi64(x, y, z, 0xca)
+#define V8_MAJ(x, y, z) _mm512_ternarylogic_epi64(x, y, z, 0xe8)
+
+/* gcc's _mm512_undefined_epi32() trips -Wuninitialized when inlined here */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#define BDAY_FUNC   sha512_birthday_x8_avx512
+#define BDAY_ATTR   AVX512_TARGET
+#define BDAY_VEC    __m512i
+#define V_SET1(x)   _mm512_set1_epi64(x)
+#define V_ADD       V8_ADD
+#define V_F1        V8_F1
+#define V_F2        V8_F2
+#define V_F3        V8_F3
+#define V_F4        V8_F4
+#define V_CH        V8_CH
+#define V_MAJ       V8_MAJ
+#define V_NONCE(n)  _mm512_slli_epi64(_mm512_set_epi64(                      \
+                        BSWAP32((n)[7]), BSWAP32((n)[6]),                   \
+                        BSWAP32((n)[5]), BSWAP32((n)[4]),                   \
+                        BSWAP32((n)[3]), BSWAP32((n)[2]),                   \
+                        BSWAP32((n)[1]), BSWAP32((n)[0])), 32)
+#define V_STORE(st, digest)                                                 \
+{                                                                           \
+    uint64 out[8][8] __attribute__((aligned(64)));                          \
+    int i;                                                                  \
+    for (j = 0; j < 8; j++) {                                               \
+        _mm512_store_si512((__m512i *)out[j],                               \
+            V8_ADD((st)[j], _mm512_set1_epi64(sha512_h0[j])));              \
+    }                                                                       \
+    for (i = 0; i < 8; i++)                                                 \
+        for (j = 0; j < 8; j++)                                             \
+            (digest)[i * 8 + j] = __builtin_bswap64(out[j][i]);             \
+}
+#include "sha512_bday_body.h"
+#undef BDAY_FUNC
+#undef BDAY_ATTR
+#undef BDAY_VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_F1
+#undef V_F2
+#undef V_F3
+#undef V_F4
+#undef V_CH
+#undef V_MAJ
+#undef V_NONCE
+#undef V_STORE
+
+#pragma GCC diagnostic pop
+
+#endif /* SHA512_MB_X86 */
+
+const char *sha512_mb_name(unsigned int lanes)
+{
+    switch (lanes) {
+    case 4:
+        return "AVX2";
+    case 8:
+        return "AVX-512";
+    default:
+        return "scalar";
+    }
+}
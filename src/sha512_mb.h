@@ -0,0 +1,76 @@
+/*
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef SHA512_MB_H
+#define SHA512_MB_H
+
+#include "sha2.h"
+
+/* Multi-buffer SHA-512 for Momentum birthdays: 36-byte nonce || midhash. */
+#define SHA512_MB_MSG_SIZE      36
+#define SHA512_MB_MAX_LANES     8
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA512_MB_X86
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* "scalar", "AVX2" or "AVX-512" for the lane count sha512_birthday_select() gave. */
+const char *sha512_mb_name(unsigned int lanes);
+
+/*
+ * Fixed-shape birthday hash: every message is a 4-byte nonce followed by
+ * the same midhash, so only the high half of w[0] changes. Everything
+ * that does not depend on the nonce is computed once per midhash.
+ */
+typedef struct {
+    uint64 w[16];   /* padded block, nonce half of w[0] zeroed */
+    uint64 wc[80];  /* nonce independent part of each schedule word */
+    uint64 kw[80];  /* k[t] + w[t] when w[t] is nonce independent, else k[t] */
+    uint64 st[8];   /* a..h after round 0, a and e still lack the nonce */
+} sha512_birthday_ctx;
+
+void sha512_birthday_init(sha512_birthday_ctx *ctx,
+                          const unsigned char *midhash);
+
+/*
+ * Digest of nonce[lane] || midhash. digest[lane * 8 + i] holds word i as
+ * sha512() lays it out in memory, so the birthday is simply
+ * digest[...] >> (64 - SEARCH_SPACE_BITS).
+ */
+typedef void (*sha512_birthday_func)(const sha512_birthday_ctx *ctx,
+                                     const uint32 *nonce, uint64 *digest);
+
+/*
+ * Pick the widest path the CPU and OS support (cpuid + xgetbv):
+ * scalar (1 lane), AVX2 (4 lanes) or AVX-512 (8 lanes).
+ */
+sha512_birthday_func sha512_birthday_select(unsigned int *lanes);
+
+void sha512_birthday(const sha512_birthday_ctx *ctx, const uint32 *nonce,
+                     uint64 *digest);
+
+#ifdef SHA512_MB_X86
+void sha512_birthday_x4_avx2(const sha512_birthday_ctx *ctx,
+                             const uint32 *nonce, uint64 *digest);
+void sha512_birthday_x8_avx512(const sha512_birthday_ctx *ctx,
+                               const uint32 *nonce, uint64 *digest);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !SHA512_MB_H */